@@ -72,7 +72,7 @@ conv_os2point(const EC_GROUP *grp, const ASN1_OCTET_STRING *os, EC_POINT *p,
               BN_CTX *ctx)
 {
     if (EC_POINT_oct2point(grp, p, os->data, os->length, ctx) <= 0)
-        return ENOMEM;
+        return EINVAL;
 
     if (EC_POINT_is_on_curve(grp, p, ctx) == 0)
         return EINVAL;
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "grp.h"
+
+#include <openssl/objects.h>
+#include <openssl/opensslconf.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GRP_MAX 32
+
+static struct {
+    int nid;
+    EC_GROUP *grp;
+} grps[GRP_MAX];
+static size_t ngrps;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static grp_oids_t oids;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static const EC_METHOD *
+method(int nid)
+{
+    switch (nid) {
+#ifndef OPENSSL_NO_EC_NISTP_64_GCC_128
+    case NID_secp224r1: return EC_GFp_nistp224_method();
+    case NID_X9_62_prime256v1: return EC_GFp_nistp256_method();
+    case NID_secp521r1: return EC_GFp_nistp521_method();
+#endif
+    default: return NULL;
+    }
+}
+
+static EC_GROUP *
+build(int nid)
+{
+    const EC_METHOD *meth = NULL;
+    EC_GROUP *grp = NULL;
+    EC_GROUP *tmp = NULL;
+
+    grp = EC_GROUP_new_by_curve_name(nid);
+    if (!grp)
+        return NULL;
+
+    /* Keep the library's choice unless it is one of the generic methods. */
+    meth = EC_GROUP_method_of(grp);
+    if (meth != EC_GFp_mont_method() && meth != EC_GFp_nist_method())
+        return grp;
+
+    meth = method(nid);
+    if (!meth)
+        return grp;
+
+    tmp = grp_new(nid, meth);
+    if (!tmp)
+        return grp;
+
+    EC_GROUP_free(grp);
+    return tmp;
+}
+
+/* Points can't be copied between methods, so go through octets. */
+static EC_POINT *
+convert(const EC_GROUP *from, const EC_POINT *p, const EC_GROUP *to,
+        BN_CTX *ctx)
+{
+    EC_POINT *out = NULL;
+    size_t len;
+
+    len = EC_POINT_point2oct(from, p, POINT_CONVERSION_UNCOMPRESSED,
+                             NULL, 0, ctx);
+    if (len == 0)
+        return NULL;
+
+    unsigned char buf[len];
+
+    if (EC_POINT_point2oct(from, p, POINT_CONVERSION_UNCOMPRESSED,
+                           buf, len, ctx) != len)
+        return NULL;
+
+    out = EC_POINT_new(to);
+    if (out && EC_POINT_oct2point(to, out, buf, len, ctx) <= 0) {
+        EC_POINT_free(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+EC_GROUP *
+grp_new(int nid, const EC_METHOD *meth)
+{
+    EC_GROUP *named = NULL;
+    EC_GROUP *grp = NULL;
+    EC_POINT *gen = NULL;
+    BIGNUM *cof = NULL;
+    BIGNUM *ord = NULL;
+    BN_CTX *ctx = NULL;
+    BIGNUM *p = NULL;
+    BIGNUM *a = NULL;
+    BIGNUM *b = NULL;
+
+    ctx = BN_CTX_new();
+    if (!ctx)
+        return NULL;
+
+    BN_CTX_start(ctx);
+    named = EC_GROUP_new_by_curve_name(nid);
+    if (!named)
+        goto error;
+
+    p = BN_CTX_get(ctx);
+    a = BN_CTX_get(ctx);
+    b = BN_CTX_get(ctx);
+    ord = BN_CTX_get(ctx);
+    cof = BN_CTX_get(ctx);
+    if (!cof)
+        goto error;
+
+    if (EC_GROUP_get_curve_GFp(named, p, a, b, ctx) <= 0 ||
+        EC_GROUP_get_order(named, ord, ctx) <= 0 ||
+        EC_GROUP_get_cofactor(named, cof, ctx) <= 0)
+        goto error;
+
+    grp = EC_GROUP_new(meth);
+    if (!grp || EC_GROUP_set_curve_GFp(grp, p, a, b, ctx) <= 0)
+        goto error;
+
+    gen = convert(named, EC_GROUP_get0_generator(named), grp, ctx);
+    if (!gen)
+        goto error;
+
+    if (EC_GROUP_set_generator(grp, gen, ord, cof) <= 0)
+        goto error;
+
+    EC_GROUP_set_curve_name(grp, nid);
+    EC_GROUP_set_asn1_flag(grp, OPENSSL_EC_NAMED_CURVE);
+
+    EC_POINT_free(gen);
+    EC_GROUP_free(named);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return grp;
+
+error:
+    EC_POINT_free(gen);
+    EC_GROUP_free(grp);
+    EC_GROUP_free(named);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return NULL;
+}
+
+const EC_GROUP *
+grp_get(int nid)
+{
+    EC_GROUP *grp = NULL;
+    size_t n;
+
+    /* Entries are only ever appended, so lookups need no lock. */
+    n = __atomic_load_n(&ngrps, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        if (grps[i].nid == nid)
+            return grps[i].grp;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    for (size_t i = n; i < ngrps; i++) {
+        if (grps[i].nid == nid) {
+            grp = grps[i].grp;
+            goto egress;
+        }
+    }
+
+    if (ngrps == GRP_MAX)
+        goto egress;
+
+    grp = build(nid);
+    if (!grp)
+        goto egress;
+
+    grps[ngrps].nid = nid;
+    grps[ngrps].grp = grp;
+    __atomic_store_n(&ngrps, ngrps + 1, __ATOMIC_RELEASE);
+
+egress:
+    pthread_mutex_unlock(&lock);
+    return grp;
+}
+
+static void
+load_oids(void)
+{
+    size_t n = EC_get_builtin_curves(NULL, 0);
+
+    if (n == 0)
+        return;
+
+    EC_builtin_curve curves[n];
+    int nids[n];
+
+    if (EC_get_builtin_curves(curves, n) != n)
+        return;
+
+    for (size_t i = 0; i < n; i++)
+        nids[i] = curves[i].nid;
+
+    grp_oids_init(&oids, nids, n);
+}
+
+int
+grp_oid2nid(const unsigned char *oid, size_t len)
+{
+    pthread_once(&once, load_oids);
+    return grp_oids_find(&oids, oid, len);
+}
+
+size_t
+grp_oid(const ASN1_OBJECT *obj, unsigned char oid[GRP_OID])
+{
+    unsigned char der[GRP_OID + 2];
+    unsigned char *p = der;
+    int len;
+
+    len = obj ? i2d_ASN1_OBJECT((ASN1_OBJECT *) obj, NULL) : 0;
+    if (len <= 2 || (size_t) len > sizeof(der))
+        return 0;
+
+    if (i2d_ASN1_OBJECT((ASN1_OBJECT *) obj, &p) != len)
+        return 0;
+
+    memcpy(oid, &der[2], len - 2);
+    return len - 2;
+}
+
+int
+grp_oids_init(grp_oids_t *tab, const int *nids, size_t n)
+{
+    *tab = (grp_oids_t) {};
+    if (n == 0)
+        return 0;
+
+    tab->oids = calloc(n, sizeof(*tab->oids));
+    if (!tab->oids)
+        return ENOMEM;
+
+    for (size_t i = 0; i < n; i++) {
+        struct grp_oid *o = &tab->oids[tab->n];
+
+        o->len = grp_oid(OBJ_nid2obj(nids[i]), o->oid);
+        if (o->len == 0)
+            continue;
+
+        o->nid = nids[i];
+        tab->n++;
+    }
+
+    return 0;
+}
+
+int
+grp_oids_find(const grp_oids_t *tab, const unsigned char *oid, size_t len)
+{
+    for (size_t i = 0; i < tab->n; i++) {
+        const struct grp_oid *o = &tab->oids[i];
+
+        if (o->len == len && memcmp(o->oid, oid, len) == 0)
+            return o->nid;
+    }
+
+    return NID_undef;
+}
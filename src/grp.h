@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <openssl/asn1.h>
+#include <openssl/ec.h>
+
+#define GRP_OID 16  /* Longest OBJECT IDENTIFIER contents we look up. */
+
+/* A table of the OBJECT IDENTIFIERs of some NIDs, for mapping DER back to
+ * NIDs without allocating. Tables are meant to live until exit. */
+typedef struct {
+    struct grp_oid {
+        int nid;
+        size_t len;
+        unsigned char oid[GRP_OID];
+    } *oids;
+    size_t n;
+} grp_oids_t;
+
+/* Returns the shared group for a named curve, or NULL if the curve is
+ * unknown. The group uses the fastest arithmetic available: the library's
+ * own choice when it is already specialized for the curve (e.g. nistz256),
+ * otherwise the 64-bit constant-time nistp methods where they are built in,
+ * otherwise the generic method. The group lives until exit; don't free it. */
+const EC_GROUP *
+grp_get(int nid);
+
+/* Builds a new copy of a named prime curve using the given method. */
+EC_GROUP *
+grp_new(int nid, const EC_METHOD *meth);
+
+/* Maps the contents of a DER OBJECT IDENTIFIER to a built-in curve's NID,
+ * without allocating. Returns NID_undef for anything else. */
+int
+grp_oid2nid(const unsigned char *oid, size_t len);
+
+/* Copies the contents of a DER OBJECT IDENTIFIER, which always follow a two
+ * byte header, into oid. Returns their length, or zero if they don't fit. */
+size_t
+grp_oid(const ASN1_OBJECT *obj, unsigned char oid[GRP_OID]);
+
+/* Builds a table of the given NIDs' OIDs, leaving out any without one.
+ * Returns ENOMEM if the table can't be allocated. */
+int
+grp_oids_init(grp_oids_t *tab, const int *nids, size_t n);
+
+/* Maps the contents of a DER OBJECT IDENTIFIER to a NID in the table.
+ * Returns NID_undef for anything else. */
+int
+grp_oids_find(const grp_oids_t *tab, const unsigned char *oid, size_t len);
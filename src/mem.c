@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mem.h"
+
+#include <openssl/crypto.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEM_MIN 16      /* Smallest block size; classes are powers of two. */
+#define MEM_CLASSES 10  /* So the largest cached block is 8 KiB. */
+#define MEM_DEPTH 64    /* Most free blocks cached per class and thread. */
+#define MEM_LARGE UINT32_MAX
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define MEM_ARGS
+#define MEM_PASS
+#else
+#define MEM_ARGS , const char *file, int line
+#define MEM_PASS , file, line
+#endif
+
+/* Every block is preceded by its class and size, padded for alignment. */
+typedef union {
+    struct {
+        uint32_t cls;
+        size_t size;
+    };
+    long double align;
+} hdr_t;
+
+typedef struct blk {
+    struct blk *next;
+} blk_t;
+
+static __thread struct {
+    blk_t *head[MEM_CLASSES];
+    size_t count[MEM_CLASSES];
+} cache;
+
+static size_t nsys;
+static bool installed;
+
+static void *
+sys_malloc(size_t size)
+{
+    __atomic_add_fetch(&nsys, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void
+sys_free(void *ptr)
+{
+    __atomic_add_fetch(&nsys, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static uint32_t
+classify(size_t size)
+{
+    for (uint32_t cls = 0; cls < MEM_CLASSES; cls++) {
+        if (size <= (size_t) MEM_MIN << cls)
+            return cls;
+    }
+
+    return MEM_LARGE;
+}
+
+static void *
+mem_malloc(size_t size MEM_ARGS)
+{
+    uint32_t cls = classify(size);
+    hdr_t *hdr = NULL;
+
+    if (cls != MEM_LARGE)
+        size = (size_t) MEM_MIN << cls;
+
+    if (cls != MEM_LARGE && cache.head[cls]) {
+        hdr = (hdr_t *) cache.head[cls];
+        cache.head[cls] = cache.head[cls]->next;
+        cache.count[cls]--;
+    } else {
+        hdr = sys_malloc(sizeof(*hdr) + size);
+        if (!hdr)
+            return NULL;
+    }
+
+    hdr->cls = cls;
+    hdr->size = size;
+    return hdr + 1;
+}
+
+static void
+mem_free(void *ptr MEM_ARGS)
+{
+    hdr_t *hdr = ptr;
+    uint32_t cls;
+
+    if (!ptr)
+        return;
+
+    cls = (--hdr)->cls;
+    if (cls == MEM_LARGE || cache.count[cls] >= MEM_DEPTH) {
+        sys_free(hdr);
+        return;
+    }
+
+    /* The header is dead while cached, so the link overwrites it. */
+    ((blk_t *) hdr)->next = cache.head[cls];
+    cache.head[cls] = (blk_t *) hdr;
+    cache.count[cls]++;
+}
+
+static void *
+mem_realloc(void *ptr, size_t size MEM_ARGS)
+{
+    const hdr_t *hdr = ptr;
+    void *tmp;
+
+    if (!ptr)
+        return mem_malloc(size MEM_PASS);
+
+    if (size == 0) {
+        mem_free(ptr MEM_PASS);
+        return NULL;
+    }
+
+    if (classify(size) == hdr[-1].cls && size <= hdr[-1].size)
+        return ptr;
+
+    tmp = mem_malloc(size MEM_PASS);
+    if (!tmp)
+        return NULL;
+
+    memcpy(tmp, ptr, hdr[-1].size < size ? hdr[-1].size : size);
+    mem_free(ptr MEM_PASS);
+    return tmp;
+}
+
+void
+mem_flush(void)
+{
+    for (uint32_t cls = 0; cls < MEM_CLASSES; cls++) {
+        while (cache.head[cls]) {
+            blk_t *blk = cache.head[cls];
+            cache.head[cls] = blk->next;
+            sys_free(blk);
+        }
+
+        cache.count[cls] = 0;
+    }
+}
+
+int
+mem_init(void)
+{
+    /* A child of a process that called this inherits the caches. */
+    if (installed)
+        return 0;
+
+    if (CRYPTO_set_mem_functions(mem_malloc, mem_realloc, mem_free) == 0)
+        return EBUSY;
+
+    installed = true;
+    return 0;
+}
+
+size_t
+mem_sys(void)
+{
+    return __atomic_load_n(&nsys, __ATOMIC_RELAXED);
+}
@@ -16,25 +16,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "list.h"
+#pragma once
+
 #include <stddef.h>
 
-void
-list_add_after(list_t *list, list_t *item)
-{
-    item->next = list->next;
-    item->prev = list;
-    list->next->prev = item;
-    list->next = item;
-}
+/* Routes libcrypto's allocations through per-thread caches of free blocks,
+ * so that the objects each request creates and destroys are recycled rather
+ * than returned to the system allocator. Each worker thus has a cache of its
+ * own, without locks. Must be called before anything else uses libcrypto;
+ * returns EBUSY if that is too late. Calling it again does nothing. */
+int
+mem_init(void);
 
-list_t *
-list_pop(list_t *item)
-{
-    if (item == NULL)
-        return NULL;
+/* Returns the number of calls made to the system allocator on behalf of
+ * libcrypto since mem_init(). */
+size_t
+mem_sys(void);
 
-    item->prev->next = item->next;
-    item->next->prev = item->prev;
-    return item;
-}
+/* Returns the calling thread's cached blocks to the system. Threads that
+ * exit before the process does should call this first. */
+void
+mem_flush(void);
@@ -17,25 +17,508 @@
  */
 
 #include "pkt.h"
+#include "grp.h"
+
+#include <openssl/objects.h>
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define WRAP(t, v) &(t *) { (t *) v }
+#define NTYPES (sizeof(types) / sizeof(*types))
+
+/* The signature types that requests may ask for. */
+static const int types[] = {
+    NID_ecdsa_with_SHA224,
+    NID_ecdsa_with_SHA256,
+    NID_ecdsa_with_SHA384,
+    NID_ecdsa_with_SHA512,
+};
+
+/* Every error message: error [0] ENUMERATED, in its only encoding. */
+static const unsigned char errors[][5] = {
+    [TANG_MSG_ERR_INTERNAL] =
+        { 0xa0, 0x03, 0x0a, 0x01, TANG_MSG_ERR_INTERNAL },
+    [TANG_MSG_ERR_INVALID_REQUEST] =
+        { 0xa0, 0x03, 0x0a, 0x01, TANG_MSG_ERR_INVALID_REQUEST },
+    [TANG_MSG_ERR_NOTFOUND_KEY] =
+        { 0xa0, 0x03, 0x0a, 0x01, TANG_MSG_ERR_NOTFOUND_KEY },
+};
+
+static grp_oids_t oids;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+int
+pkt_init(pkt_t *pkt)
+{
+    *pkt = (pkt_t) {};
+    return pkt_reserve(pkt, PKT_MTU);
+}
+
+int
+pkt_reserve(pkt_t *pkt, size_t size)
+{
+    size_t cap = pkt->cap > 0 ? pkt->cap : PKT_MTU;
+    unsigned char *data = NULL;
+
+    pkt->view = NULL;
+
+    if (size <= pkt->cap)
+        return 0;
+
+    if (size > PKT_MAX)
+        return E2BIG;
+
+    while (cap < size)
+        cap *= 2;
+
+    if (cap > PKT_MAX)
+        cap = PKT_MAX;
+
+    data = realloc(pkt->data, cap);
+    if (!data)
+        return ENOMEM;
+
+    pkt->data = data;
+    pkt->cap = cap;
+    return 0;
+}
+
+void
+pkt_cleanup(pkt_t *pkt)
+{
+    free(pkt->data);
+    *pkt = (pkt_t) {};
+}
+
+void
+pkt_view(pkt_t *pkt, const unsigned char *data, size_t size)
+{
+    pkt->view = data;
+    pkt->size = size;
+}
+
+const unsigned char *
+pkt_data(const pkt_t *pkt)
+{
+    return pkt->view ? pkt->view : pkt->data;
+}
 
 int
 pkt_encode(const ASN1_VALUE *val, const ASN1_ITEM *it, pkt_t *pkt)
 {
-    pkt_t tmp = {};
+    int size;
+    int r;
+
+    pkt->size = 0;
+
+    size = ASN1_item_ex_i2d(WRAP(ASN1_VALUE, val), NULL, it, -1, 0);
+    if (size <= 0)
+        return EINVAL;
+
+    r = pkt_reserve(pkt, size);
+    if (r != 0)
+        return r;
+
+    size = ASN1_item_ex_i2d(WRAP(ASN1_VALUE, val),
+                            WRAP(unsigned char, pkt->data),
+                            it, -1, 0);
+    if (size <= 0)
+        return EINVAL;
+
+    pkt->size = size;
+    return 0;
+}
+
+int
+pkt_err(pkt_t *pkt, TANG_MSG_ERR err)
+{
+    int r;
+
+    pkt->size = 0;
+
+    if (err <= TANG_MSG_ERR_NONE ||
+        (size_t) err >= sizeof(errors) / sizeof(*errors))
+        return EINVAL;
+
+    r = pkt_reserve(pkt, sizeof(*errors));
+    if (r != 0)
+        return r;
+
+    memcpy(pkt->data, errors[err], sizeof(*errors));
+    pkt->size = sizeof(*errors);
+    return 0;
+}
+
+/* Finds the size of a DER header for contents of len bytes. */
+static size_t
+hdrlen(size_t len)
+{
+    return len < 0x80 ? 2 : len < 0x100 ? 3 : 4;
+}
+
+/* Writes a DER header, returning its size. Lengths are below PKT_MAX. */
+static size_t
+header(unsigned char *buf, unsigned char tag, size_t len)
+{
+    size_t n = 0;
+
+    buf[n++] = tag;
+    if (len >= 0x100) {
+        buf[n++] = 0x82;
+        buf[n++] = len >> 8;
+    } else if (len >= 0x80) {
+        buf[n++] = 0x81;
+    }
+
+    buf[n++] = len;
+    return n;
+}
+
+unsigned char *
+pkt_rec_rep(pkt_t *pkt, size_t ylen)
+{
+    size_t os = hdrlen(ylen) + ylen;
+    size_t y = hdrlen(os) + os;
+    size_t seq = hdrlen(y) + y;
+    size_t size = hdrlen(seq) + seq;
+    size_t off = 0;
+
+    pkt->size = 0;
+
+    if (size > PKT_MAX || pkt_reserve(pkt, size) != 0)
+        return NULL;
+
+    /* rec-rep [2] SEQUENCE { y [0] OCTET STRING } */
+    off += header(&pkt->data[off], 0xa2, seq);
+    off += header(&pkt->data[off], 0x30, y);
+    off += header(&pkt->data[off], 0xa0, os);
+    off += header(&pkt->data[off], 0x04, ylen);
+
+    pkt->size = size;
+    return &pkt->data[off];
+}
+
+int
+pkt_frame(const unsigned char *buf, size_t len, size_t *size)
+{
+    size_t hdr = 2;
+    size_t val = 0;
+
+    if (len < hdr)
+        return EAGAIN;
+
+    /* We only speak low tag numbers. */
+    if ((buf[0] & 0x1f) == 0x1f)
+        return EINVAL;
+
+    if (buf[1] & 0x80) {
+        hdr += buf[1] & 0x7f;
+        if (hdr == 2 || hdr > 2 + sizeof(uint32_t))
+            return EINVAL;
+
+        if (len < hdr)
+            return EAGAIN;
+
+        for (size_t i = 2; i < hdr; i++)
+            val = val << 8 | buf[i];
+    } else {
+        val = buf[1];
+    }
+
+    if (len - hdr < val)
+        return EAGAIN;
+
+    *size = hdr + val;
+    return 0;
+}
+
+int
+pkt_split(pkt_t *buf, pkt_t *pkts, size_t *npkts)
+{
+    size_t off = 0;
+    size_t n = 0;
+    int r = 0;
+
+    for (size_t size; n < *npkts; n++, off += size) {
+        r = pkt_frame(&buf->data[off], buf->size - off, &size);
+        if (r == 0)
+            r = pkt_reserve(&pkts[n], size);
+        if (r != 0)
+            break;
+
+        memcpy(pkts[n].data, &buf->data[off], size);
+        pkts[n].size = size;
+    }
+
+    buf->size -= off;
+    if (off > 0)
+        memmove(buf->data, &buf->data[off], buf->size);
+
+    *npkts = n;
+    if (n > 0)
+        return 0;
+
+    if (r == EAGAIN && buf->size >= PKT_MAX)
+        return EINVAL;
+
+    return r;
+}
+
+/* Reads one element with the given tag, returning its contents. */
+static const unsigned char *
+tlv(const unsigned char **buf, const unsigned char *end, unsigned char tag,
+    size_t *len)
+{
+    const unsigned char *p = *buf;
+    size_t size;
+
+    if (p >= end || *p != tag || pkt_frame(p, end - p, &size) != 0)
+        return NULL;
+
+    *buf = p + size;
+    p += p[1] & 0x80 ? 2 + (p[1] & 0x7f) : 2;
+    *len = *buf - p;
+    return p;
+}
+
+/* Reads an explicitly tagged element: [tag] holding exactly one inner. */
+static const unsigned char *
+explicit(const unsigned char **buf, const unsigned char *end,
+         unsigned char tag, unsigned char inner, size_t *len)
+{
+    const unsigned char *val;
+    const unsigned char *in;
+    size_t l;
+
+    val = tlv(buf, end, tag, &l);
+    if (!val)
+        return NULL;
+
+    in = tlv(&val, val + l, inner, len);
+    if (!in || val != *buf)
+        return NULL;
+
+    return in;
+}
+
+/* Reads the contents of a TangKey ::= SEQUENCE { grp [0] OID,
+ * key [1] OCTET STRING, use [2] ENUMERATED }. */
+static int
+tangkey(const unsigned char *key, const unsigned char *end, int *grp,
+        const unsigned char **pub, size_t *publen)
+{
+    const unsigned char *oid;
+    size_t olen;
+    size_t len;
+
+    oid = explicit(&key, end, 0xa0, 0x06, &olen);
+    *pub = explicit(&key, end, 0xa1, 0x04, publen);
+    if (!oid || !*pub || !explicit(&key, end, 0xa2, 0x0a, &len))
+        return EINVAL;
+    if (key != end)
+        return EINVAL;
+
+    *grp = grp_oid2nid(oid, olen);
+    return 0;
+}
+
+int
+pkt_parse_rec(const pkt_t *pkt, pkt_rec_t *rec)
+{
+    const unsigned char *end = &pkt->data[pkt->size];
+    const unsigned char *p = pkt->data;
+    const unsigned char *body;
+    const unsigned char *bend;
+    const unsigned char *key;
+    size_t len;
+
+    if (pkt->size <= 0)
+        return EINVAL;
+
+    /* rec-req [1] SEQUENCE { key [0] TangKey, x [1] OCTET STRING } */
+    body = explicit(&p, end, 0xa1, 0x30, &len);
+    if (!body || p != end)
+        return EINVAL;
+    bend = body + len;
 
-    tmp.size = ASN1_item_ex_i2d(WRAP(ASN1_VALUE, val), NULL, it, -1, 0);
-    if (tmp.size > (typeof(tmp.size)) sizeof(tmp.data)) return E2BIG;
-    if (tmp.size <= 0) return EINVAL;
+    key = explicit(&body, bend, 0xa0, 0x30, &len);
+    if (!key || tangkey(key, key + len, &rec->grp, &rec->key,
+                        &rec->keylen) != 0)
+        return EINVAL;
 
-    tmp.size = ASN1_item_ex_i2d(WRAP(ASN1_VALUE, val),
-                                WRAP(unsigned char, tmp.data),
-                                it, -1, 0);
-    if (tmp.size <= 0) return EINVAL;
+    rec->x = explicit(&body, bend, 0xa1, 0x04, &rec->xlen);
+    if (!rec->x || body != bend)
+        return EINVAL;
+
+    if (rec->grp == NID_undef)
+        return EINVAL;
 
-    *pkt = tmp;
     return 0;
 }
+
+static void
+load_oids(void)
+{
+    grp_oids_init(&oids, types, NTYPES);
+}
+
+static int
+type_oid2nid(const unsigned char *oid, size_t len)
+{
+    pthread_once(&once, load_oids);
+    return grp_oids_find(&oids, oid, len);
+}
+
+/* Adds a NID to a set, unless it is unknown or already there. */
+static void
+insert(pkt_set_t *set, int nid)
+{
+    size_t i = 0;
+
+    if (nid == NID_undef)
+        return;
+
+    while (i < set->n && set->nids[i] < nid)
+        i++;
+
+    if (i < set->n && set->nids[i] == nid)
+        return;
+
+    memmove(&set->nids[i + 1], &set->nids[i], (set->n - i) * sizeof(int));
+    set->nids[i] = nid;
+    set->n++;
+}
+
+/* Reads the contents of a SET OF OBJECT IDENTIFIER. Parsing stops as soon
+ * as the set proves too large, so hostile sets cost no more than others. */
+static int
+set_parse(const unsigned char *p, const unsigned char *end,
+          int (*oid2nid)(const unsigned char *, size_t), pkt_set_t *set)
+{
+    size_t count = 0;
+
+    for (; p < end; count++) {
+        const unsigned char *oid;
+        size_t len;
+
+        if (count == PKT_OIDS)
+            return E2BIG;
+
+        oid = tlv(&p, end, 0x06, &len);
+        if (!oid)
+            return EINVAL;
+
+        insert(set, oid2nid(oid, len));
+    }
+
+    set->restricted = count > 0;
+    return 0;
+}
+
+static int
+set_norm(STACK_OF(ASN1_OBJECT) *objs,
+         int (*oid2nid)(const unsigned char *, size_t), pkt_set_t *set)
+{
+    int count = sk_ASN1_OBJECT_num(objs);
+
+    if (count > PKT_OIDS)
+        return E2BIG;
+
+    for (int i = 0; i < count; i++) {
+        unsigned char oid[GRP_OID];
+        size_t len;
+
+        len = grp_oid(sk_ASN1_OBJECT_value(objs, i), oid);
+        if (len > 0)
+            insert(set, oid2nid(oid, len));
+    }
+
+    set->restricted = count > 0;
+    return 0;
+}
+
+int
+pkt_parse_adv(const pkt_t *pkt, pkt_adv_t *adv)
+{
+    const unsigned char *end = &pkt->data[pkt->size];
+    const unsigned char *p = pkt->data;
+    const unsigned char *body;
+    const unsigned char *bend;
+    const unsigned char *set;
+    const unsigned char *key;
+    const unsigned char *c;
+    size_t len;
+    int r;
+
+    if (pkt->size <= 0)
+        return EINVAL;
+
+    *adv = (pkt_adv_t) {};
+
+    /* adv-req [3] SEQUENCE { types [0] SET OF OID, body [1] CHOICE } */
+    body = explicit(&p, end, 0xa3, 0x30, &len);
+    if (!body || p != end)
+        return EINVAL;
+    bend = body + len;
+
+    set = explicit(&body, bend, 0xa0, 0x31, &len);
+    if (!set)
+        return EINVAL;
+
+    r = set_parse(set, set + len, type_oid2nid, &adv->types);
+    if (r != 0)
+        return r;
+
+    /* CHOICE { grps [0] SET OF OID, key [1] TangKey } */
+    c = tlv(&body, bend, 0xa1, &len);
+    if (!c || body != bend)
+        return EINVAL;
+    end = c + len;
+
+    if (c < end && *c == 0xa0) {
+        set = explicit(&c, end, 0xa0, 0x31, &len);
+        if (!set || c != end)
+            return EINVAL;
+
+        return set_parse(set, set + len, grp_oid2nid, &adv->grps);
+    }
+
+    key = explicit(&c, end, 0xa1, 0x30, &len);
+    if (!key || c != end)
+        return EINVAL;
+
+    adv->key = true;
+    return tangkey(key, key + len, &adv->grp, &adv->pub, &adv->publen);
+}
+
+int
+pkt_norm_adv(const TANG_MSG_ADV_REQ *req, pkt_adv_t *adv)
+{
+    const TANG_KEY *key = req->body->val.key;
+    int r;
+
+    *adv = (pkt_adv_t) {};
+
+    r = set_norm(req->types, type_oid2nid, &adv->types);
+    if (r != 0)
+        return r;
+
+    switch (req->body->type) {
+    case TANG_MSG_ADV_REQ_BDY_TYPE_GRPS:
+        return set_norm(req->body->val.grps, grp_oid2nid, &adv->grps);
+
+    case TANG_MSG_ADV_REQ_BDY_TYPE_KEY:
+        adv->key = true;
+        adv->grp = OBJ_obj2nid(key->grp);
+        adv->pub = key->key->data;
+        adv->publen = key->key->length;
+        return 0;
+
+    default:
+        return EINVAL;
+    }
+}
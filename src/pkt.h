@@ -18,12 +18,121 @@
 
 #pragma once
 
+#include "asn1.h"
+
 #include <openssl/asn1t.h>
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PKT_MTU 1500    /* Initial capacity; enough for almost any message. */
+#define PKT_MAX 65535   /* Largest message we will send or receive. */
+
+/* Most objects a request may filter by, per set. Sets are held inline so
+ * that parsing never allocates, which is why this is fixed at build time
+ * (say, with CPPFLAGS=-DPKT_OIDS=32) rather than at run time. */
+#ifndef PKT_OIDS
+#define PKT_OIDS 16
+#endif
+
+/* A message buffer. Buffers start out MTU-sized and are reused, growing
+ * only for the rare message (such as a large advertisement) that needs it.
+ * A packet may instead view bytes kept elsewhere: see pkt_view(). */
 typedef struct {
-    unsigned char data[65535];
+    unsigned char *data;
+    size_t cap;
     int size;
+    const unsigned char *view;
 } pkt_t;
 
+/* A TangMessageRecoverRequest, viewed in place within its packet. */
+typedef struct {
+    int grp;
+    const unsigned char *key;
+    size_t keylen;
+    const unsigned char *x;
+    size_t xlen;
+} pkt_rec_t;
+
+/* A set of objects a request filters by: the NIDs of those we know, sorted
+ * and without duplicates. Larger sets are refused, so checking one against
+ * an advertisement costs little whatever the request looks like. */
+typedef struct {
+    bool restricted;    /* Whether the set named anything at all. */
+    size_t n;
+    int nids[PKT_OIDS];
+} pkt_set_t;
+
+/* A TangMessageAdvertiseRequest, normalized. A request names either a set
+ * of groups or a single key, whose public point is viewed in place. */
+typedef struct {
+    pkt_set_t types;
+    bool key;
+    pkt_set_t grps;
+    int grp;
+    const unsigned char *pub;
+    size_t publen;
+} pkt_adv_t;
+
+/* Gives an empty packet its initial capacity. */
+int
+pkt_init(pkt_t *pkt);
+
+/* Makes room for at least size bytes, keeping the contents. */
+int
+pkt_reserve(pkt_t *pkt, size_t size);
+
+/* Releases the buffer, leaving an empty packet. */
+void
+pkt_cleanup(pkt_t *pkt);
+
+/* Makes the packet's contents size bytes at data without copying them. The
+ * bytes must stay put until the packet is written to again. */
+void
+pkt_view(pkt_t *pkt, const unsigned char *data, size_t size);
+
+/* Returns the packet's contents, wherever they are. */
+const unsigned char *
+pkt_data(const pkt_t *pkt);
+
+/* Encodes val straight into the packet's buffer, growing it if needed. */
 int
 pkt_encode(const ASN1_VALUE *val, const ASN1_ITEM *it, pkt_t *pkt);
+
+/* Writes the error message for err, which is copied from a table rather
+ * than encoded. */
+int
+pkt_err(pkt_t *pkt, TANG_MSG_ERR err);
+
+/* Writes the headers of a TangMessageRecoverReply whose point is ylen bytes
+ * long, sizing the packet to fit. Returns where the point goes, or NULL. */
+unsigned char *
+pkt_rec_rep(pkt_t *pkt, size_t ylen);
+
+/* Finds the size of the first complete DER element in buf. Returns EAGAIN
+ * if buf holds only part of it. */
+int
+pkt_frame(const unsigned char *buf, size_t len, size_t *size);
+
+/* Moves up to *npkts complete DER elements from the front of buf into pkts,
+ * setting *npkts to the number moved. Returns EAGAIN if there are none yet
+ * and EINVAL if buf holds PKT_MAX bytes without a complete element. */
+int
+pkt_split(pkt_t *buf, pkt_t *pkts, size_t *npkts);
+
+/* Parses a recovery request in place, without allocating. Returns EINVAL if
+ * pkt isn't one in the usual encoding; d2i_TANG_MSG() has the final word. */
+int
+pkt_parse_rec(const pkt_t *pkt, pkt_rec_t *rec);
+
+/* Parses an advertisement request in place, without allocating. Returns
+ * E2BIG if a set holds more than PKT_OIDS objects and EINVAL if pkt isn't
+ * an advertisement request in the usual encoding. */
+int
+pkt_parse_adv(const pkt_t *pkt, pkt_adv_t *adv);
+
+/* Normalizes an advertisement request that d2i_TANG_MSG() decoded, in the
+ * same way as pkt_parse_adv(). Returns E2BIG if a set is too large. The
+ * result refers to req's key, so it must outlive adv. */
+int
+pkt_norm_adv(const TANG_MSG_ADV_REQ *req, pkt_adv_t *adv);
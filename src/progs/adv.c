@@ -17,6 +17,7 @@
  */
 
 #include "../conv.h"
+#include "../mem.h"
 #include "adv.h"
 #include "rec.h"
 
@@ -25,20 +26,75 @@
 #include <openssl/objects.h>
 #include <openssl/sha.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #define KEYLEN(k) ((k)->grp->length + (k)->key->length)
 
+#define ADV_CACHE 64    /* Distinct filters remembered per advertisement. */
+#define ADV_WAYS 4      /* Entries a filter may take, of those. */
+#define ADV_RETIRED 256 /* Most replaced entries waiting to be freed. */
+#define ADV_FILTER 512  /* Longest normalized filter that will be cached. */
+#define ADV_THREADS 16  /* Most threads used to sign an advertisement. */
+
+#define ADV_FILE ".tang-sigs"   /* Signature cache, kept in the database. */
+#define ADV_MAGIC "TANGSIG1"
+
+#define NSUPPORTED (sizeof(supported) / sizeof(*supported))
+#define NSETS (ADV_CACHE / ADV_WAYS)
+
 typedef struct {
     TANG_SIG *sig;
-    TANG_KEY *key;
-    bool adv;
 } sig_t;
 
-struct adv {
-    TANG_MSG_ADV_REP *rep;
-    sig_t **sigs;
-};
+/* The signature cache file starts with this header. Then come the body that
+ * was signed and one record per signature. Signatures are only reused for
+ * the very same body and signing key, so a stale file is merely useless. */
+typedef struct {
+    char magic[8];
+    uint32_t blen;
+    uint32_t nrecs;
+    unsigned char digest[SHA256_DIGEST_LENGTH]; /* Of everything after. */
+} file_hdr_t;
+
+/* A signature record: the signing key's curve and public point, then the
+ * DER-encoded signature. */
+typedef struct {
+    int32_t sign;
+    int32_t nid;
+    uint32_t publen;
+    uint32_t siglen;
+} file_rec_t;
+
+/* A cached answer: the normalized filter, then the encoded reply. Only
+ * used changes once an entry is published. */
+typedef struct {
+    uint32_t hash;
+    bool used;          /* Hit since the clock last passed it. */
+    size_t flen;
+    size_t rlen;
+    TANG_MSG_ERR err;
+    unsigned char data[];
+} entry_t;
+
+/* Answers by filter, in sets of ADV_WAYS entries. Lookups take no lock.
+ * Entries are replaced second chance style, and those replaced are kept
+ * until adv_retired() hands them over: replies may still point into them. */
+typedef struct {
+    pthread_mutex_t lock;   /* Held to change entries. */
+    entry_t *entries[ADV_CACHE];
+    uint8_t hands[NSETS];
+    entry_t *dead[ADV_RETIRED];
+    size_t ndead;
+} cache_t;
 
 static const struct {
     int sign;
@@ -50,6 +106,64 @@ static const struct {
     { NID_ecdsa_with_SHA512, NID_sha512 },
 };
 
+/* Advertised signatures sharing a digest and a curve. Requests that filter
+ * by digest or curve select whole groups. */
+typedef struct {
+    size_t first;       /* In adv->grouped. */
+    size_t count;
+    size_t type;        /* In supported[]. */
+    size_t curve;       /* In adv->curves. */
+} group_t;
+
+/* A signing key, with its signature under each digest, for requests that
+ * name a key. */
+typedef struct {
+    uint32_t fp;
+    int grp;
+    const ASN1_OCTET_STRING *pub;   /* Owned by the advertisement's keys. */
+    TANG_SIG *sigs[NSUPPORTED];     /* By digest, as in supported[]. */
+} signer_t;
+
+struct adv {
+    TANG_MSG_ADV_REP *rep;
+    unsigned char *body;    /* The encoded body that was signed. */
+    size_t blen;
+    TANG_KEY **keys;    /* Some may be NULL, if making them failed. */
+    size_t nkeys;
+    sig_t **sigs;       /* Likewise. */
+    size_t nsigs;
+    bool fresh;         /* Some signatures were made rather than loaded. */
+    cache_t *cache;
+
+    /* What sign() selects from, built by index_build(). */
+    TANG_SIG **grouped;
+    group_t *groups;
+    size_t ngroups;
+    int *curves;        /* Of advertised signing keys, sorted. */
+    size_t ncurves;
+    signer_t *signers;  /* Sorted by fingerprint. */
+    size_t nsigners;
+};
+
+/* The work of signing a body: every signing key with every digest. Keys
+ * are handed out to threads one at a time, and each result has a fixed
+ * slot, so the outcome does not depend on scheduling. */
+typedef struct {
+    struct {
+        unsigned char buf[EVP_MAX_MD_SIZE];
+        unsigned int len;
+        int sign;
+    } hashes[NSUPPORTED];
+    size_t nhashes;
+    const db_key_t **keys;
+    size_t nkeys;
+    TANG_KEY **gkeys;
+    sig_t **sigs;
+    size_t nfresh;      /* Signatures made rather than loaded. */
+    size_t next;
+    bool failed;
+} job_t;
+
 static void
 sig_free(sig_t *sig)
 {
@@ -57,32 +171,18 @@ sig_free(sig_t *sig)
         return;
 
     TANG_SIG_free(sig->sig);
-    TANG_KEY_free(sig->key);
     free(sig);
 }
 
 static sig_t *
-make_sig(int nid, const db_key_t *key, const unsigned char *hash, size_t hlen,
-         BN_CTX *ctx)
+new_sig(int nid, const unsigned char *der, size_t len)
 {
-    unsigned char *buf = NULL;
-    ECDSA_SIG *tmp = NULL;
     sig_t *sig = NULL;
-    int len = 0;
 
     sig = calloc(1, sizeof(sig_t));
     if (!sig)
         goto error;
 
-    sig->adv = key->adv;
-
-    sig->key = TANG_KEY_new();
-    if (!sig->key)
-        goto error;
-
-    if (conv_eckey2gkey(key->key, key->use, sig->key, ctx) != 0)
-        goto error;
-
     sig->sig = TANG_SIG_new();
     if (!sig->sig)
         goto error;
@@ -92,46 +192,495 @@ make_sig(int nid, const db_key_t *key, const unsigned char *hash, size_t hlen,
     if (!sig->sig->type)
         goto error;
 
-    tmp = ECDSA_do_sign(hash, hlen, key->key);
-    if (!tmp)
+    if (ASN1_OCTET_STRING_set(sig->sig->sig, der, len) <= 0)
         goto error;
 
+    return sig;
+
+error:
+    sig_free(sig);
+    return NULL;
+}
+
+static sig_t *
+make_sig(int nid, EC_KEY *key, const unsigned char *hash, size_t hlen)
+{
+    unsigned char *buf = NULL;
+    ECDSA_SIG *tmp = NULL;
+    sig_t *sig = NULL;
+    int len = 0;
+
+    tmp = ECDSA_do_sign(hash, hlen, key);
+    if (!tmp)
+        return NULL;
+
     len = i2d_ECDSA_SIG(tmp, &buf);
     ECDSA_SIG_free(tmp);
-    if (len < 1)
-        goto error;
-
-    if (ASN1_OCTET_STRING_set(sig->sig->sig, buf, len) <= 0)
-        goto error;
+    if (len > 0)
+        sig = new_sig(nid, buf, len);
 
     OPENSSL_free(buf);
     return sig;
+}
 
-error:
-    OPENSSL_free(buf);
-    sig_free(sig);
+/* Describes a key as advertised, from what the db knows without its private
+ * key. */
+static int
+make_key(const db_key_t *k, TANG_KEY *key)
+{
+    ASN1_OBJECT_free(key->grp);
+    key->grp = OBJ_nid2obj(k->nid);
+    if (!key->grp)
+        return ENOMEM;
+
+    if (ASN1_OCTET_STRING_set(key->key, k->pub, k->publen) <= 0)
+        return ENOMEM;
+
+    if (ASN1_ENUMERATED_set(key->use, k->use) <= 0)
+        return ENOMEM;
+
+    return 0;
+}
+
+/* Converts one signing key, once, and signs with it under every digest that
+ * has no signature loaded from the cache. The private key is only read if
+ * something needs signing. */
+static int
+sign_key(job_t *job, size_t k)
+{
+    const db_key_t *key = job->keys[k];
+    EC_KEY *ec = NULL;
+
+    job->gkeys[k] = TANG_KEY_new();
+    if (!job->gkeys[k])
+        return ENOMEM;
+
+    if (make_key(key, job->gkeys[k]) != 0)
+        return ENOMEM;
+
+    for (size_t h = 0; h < job->nhashes; h++) {
+        sig_t **sig = &job->sigs[h * job->nkeys + k];
+
+        if (!*sig) {
+            if (!ec)
+                ec = db_key_get(key);
+            if (!ec)
+                return EINVAL;
+
+            *sig = make_sig(job->hashes[h].sign, ec,
+                            job->hashes[h].buf, job->hashes[h].len);
+            if (!*sig)
+                return ENOMEM;
+
+            __atomic_add_fetch(&job->nfresh, 1, __ATOMIC_RELAXED);
+        }
+
+    }
+
+    return 0;
+}
+
+static void
+run(job_t *job)
+{
+    for (size_t k; !__atomic_load_n(&job->failed, __ATOMIC_RELAXED); ) {
+        k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (k >= job->nkeys)
+            break;
+
+        if (sign_key(job, k) != 0)
+            __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+    }
+}
+
+static void *
+signer(void *arg)
+{
+    run(arg);
+    mem_flush();
     return NULL;
 }
 
+/* Signs using this thread and as many others as there are spare CPUs. If
+ * threads can't be started, the remaining keys are signed here. */
+static int
+sign_all(job_t *job)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t thrs[ADV_THREADS];
+    size_t nthrs = 0;
+    size_t todo = 0;
+
+    if (ncpus < 1)
+        ncpus = 1;
+    else if (ncpus > ADV_THREADS)
+        ncpus = ADV_THREADS;
+
+    /* Keys whose signatures all came from the cache only need converting. */
+    for (size_t i = 0; i < job->nhashes * job->nkeys; i++) {
+        if (!job->sigs[i])
+            todo++;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    /* Without locking callbacks, libcrypto may only be used by one thread. */
+    if (!CRYPTO_get_locking_callback())
+        ncpus = 1;
+#endif
+
+    while (nthrs + 1 < (size_t) ncpus && nthrs + 1 < todo) {
+        if (pthread_create(&thrs[nthrs], NULL, signer, job) != 0)
+            break;
+        nthrs++;
+    }
+
+    run(job);
+
+    for (size_t i = 0; i < nthrs; i++)
+        pthread_join(thrs[i], NULL);
+
+    return job->failed ? EINVAL : 0;
+}
+
+static int
+cache_path(const db_t *db, const char *name, char *path)
+{
+    int r;
+
+    r = snprintf(path, PATH_MAX, "%s/%s", db->path, name);
+    if (r < 0 || r >= PATH_MAX)
+        return E2BIG;
+
+    return 0;
+}
+
+/* Fills in the signatures that a file in the cache's format has for this
+ * body. Returns false if it isn't for this body, or is damaged; records up
+ * to the damage are still used. */
 static bool
-has_object(ASN1_OBJECT *obj, STACK_OF(ASN1_OBJECT) *set)
+parse(const unsigned char *map, size_t size,
+      const unsigned char *body, size_t blen, job_t *job)
 {
-    int nid = OBJ_obj2nid(obj);
+    unsigned char sum[SHA256_DIGEST_LENGTH];
+    const unsigned char *end = &map[size];
+    const unsigned char *p = &map[sizeof(file_hdr_t)];
+    file_hdr_t hdr;
 
-    if (sk_ASN1_OBJECT_num(set) == 0)
-        return true;
+    if (size < sizeof(hdr))
+        return false;
 
-    if (nid == NID_undef)
+    memcpy(&hdr, map, sizeof(hdr));
+    SHA256(p, end - p, sum);
+    if (memcmp(hdr.magic, ADV_MAGIC, sizeof(hdr.magic)) != 0 ||
+        memcmp(hdr.digest, sum, sizeof(sum)) != 0 ||
+        hdr.blen != blen || (size_t) (end - p) < blen ||
+        memcmp(p, body, blen) != 0)
         return false;
 
-    for (int i = 0; i < sk_ASN1_OBJECT_num(set); i++) {
-        int n = OBJ_obj2nid(sk_ASN1_OBJECT_value(set, i));
+    p += blen;
+    for (uint32_t i = 0; i < hdr.nrecs; i++) {
+        const unsigned char *pub = NULL;
+        const unsigned char *der = NULL;
+        file_rec_t rec;
+
+        if ((size_t) (end - p) < sizeof(rec))
+            return false;
+
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if ((size_t) (end - p) < (size_t) rec.publen + rec.siglen)
+            return false;
+
+        pub = p;
+        der = &p[rec.publen];
+        p += rec.publen + rec.siglen;
+
+        for (size_t k = 0; k < job->nkeys; k++) {
+            const db_key_t *key = job->keys[k];
+
+            if (!key->pub || key->nid != rec.nid ||
+                key->publen != rec.publen ||
+                memcmp(key->pub, pub, rec.publen) != 0)
+                continue;
+
+            for (size_t h = 0; h < job->nhashes; h++) {
+                sig_t **sig = &job->sigs[h * job->nkeys + k];
 
-        if (n != NID_undef && nid == n)
-            return true;
+                if (job->hashes[h].sign == rec.sign && !*sig)
+                    *sig = new_sig(rec.sign, der, rec.siglen);
+            }
+        }
     }
 
-    return false;
+    return true;
+}
+
+/* Fills in the signatures the cache file has for this body. Anything wrong
+ * with the file just means nothing is loaded. */
+static void
+cache_load(const db_t *db, const unsigned char *body, size_t blen,
+           job_t *job)
+{
+    char path[PATH_MAX];
+    const unsigned char *map = MAP_FAILED;
+    struct stat st;
+    int fd = -1;
+
+    if (cache_path(db, ADV_FILE, path) != 0)
+        return;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(file_hdr_t))
+        goto egress;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto egress;
+
+    parse(map, st.st_size, body, blen, job);
+
+egress:
+    if (map != MAP_FAILED)
+        munmap((void *) map, st.st_size);
+    close(fd);
+}
+
+/* Writes the body and every signature of the advertisement, in the cache's
+ * format, to buf if they fit in max bytes. Returns the number of bytes they
+ * take either way. */
+static size_t
+save(const adv_t *adv, unsigned char *buf, size_t max)
+{
+    file_hdr_t hdr = { .blen = adv->blen };
+    size_t size = sizeof(hdr) + adv->blen;
+    size_t off = 0;
+
+    for (size_t i = 0; i < adv->nsigners; i++) {
+        const signer_t *s = &adv->signers[i];
+
+        for (size_t t = 0; t < NSUPPORTED; t++) {
+            if (!s->sigs[t])
+                continue;
+
+            size += sizeof(file_rec_t) + s->pub->length;
+            size += s->sigs[t]->sig->length;
+            hdr.nrecs++;
+        }
+    }
+
+    if (size > max)
+        return size;
+
+    memcpy(hdr.magic, ADV_MAGIC, sizeof(hdr.magic));
+    off = sizeof(hdr);
+    memcpy(&buf[off], adv->body, adv->blen);
+    off += adv->blen;
+
+    for (size_t i = 0; i < adv->nsigners; i++) {
+        const signer_t *s = &adv->signers[i];
+
+        for (size_t t = 0; t < NSUPPORTED; t++) {
+            const ASN1_OCTET_STRING *der = NULL;
+            file_rec_t rec;
+
+            if (!s->sigs[t])
+                continue;
+
+            der = s->sigs[t]->sig;
+            rec = (file_rec_t) {
+                .sign = supported[t].sign,
+                .nid = s->grp,
+                .publen = s->pub->length,
+                .siglen = der->length,
+            };
+
+            memcpy(&buf[off], &rec, sizeof(rec));
+            off += sizeof(rec);
+            memcpy(&buf[off], s->pub->data, s->pub->length);
+            off += s->pub->length;
+            memcpy(&buf[off], der->data, der->length);
+            off += der->length;
+        }
+    }
+
+    SHA256(&buf[sizeof(hdr)], size - sizeof(hdr), hdr.digest);
+    memcpy(buf, &hdr, sizeof(hdr));
+    return size;
+}
+
+/* Writes out every signature of the advertisement, replacing the file
+ * atomically. Failing to (say, on a read-only database) only costs the next
+ * start. */
+static void
+cache_save(const db_t *db, const adv_t *adv)
+{
+    unsigned char *buf = NULL;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    size_t size = 0;
+    int fd = -1;
+
+    if (cache_path(db, ADV_FILE, path) != 0 ||
+        cache_path(db, ADV_FILE ".XXXXXX", tmp) != 0)
+        return;
+
+    size = save(adv, NULL, 0);
+    buf = malloc(size);
+    if (!buf)
+        return;
+
+    save(adv, buf, size);
+
+    /* The name starts with a dot, so the database ignores the rename. */
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        goto egress;
+
+    if (write(fd, buf, size) != (ssize_t) size || fsync(fd) != 0 ||
+        rename(tmp, path) != 0)
+        unlink(tmp);
+
+egress:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+}
+
+/* FNV-1a. */
+static uint32_t
+hash(const unsigned char *buf, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ buf[i]) * 16777619u;
+
+    return h;
+}
+
+static uint32_t
+fingerprint(int grp, const unsigned char *pub, size_t len)
+{
+    return hash(pub, len) ^ (uint32_t) grp;
+}
+
+static int
+cmp_signer(const void *a, const void *b)
+{
+    const signer_t *x = a;
+    const signer_t *y = b;
+
+    return x->fp < y->fp ? -1 : x->fp > y->fp;
+}
+
+/* Arranges the signatures for sign(): all of them by signing key, and the
+ * advertised ones by digest and curve. Groups come in digest order, then
+ * curve order; within a group, keys keep their order in the database. */
+static int
+index_build(adv_t *adv, const job_t *job)
+{
+    size_t nsigs = job->nhashes * job->nkeys;
+    size_t n = 0;
+
+    adv->signers = calloc(job->nkeys + 1, sizeof(*adv->signers));
+    adv->curves = calloc(job->nkeys + 1, sizeof(*adv->curves));
+    adv->grouped = calloc(nsigs + 1, sizeof(*adv->grouped));
+    adv->groups = calloc(nsigs + 1, sizeof(*adv->groups));
+    if (!adv->signers || !adv->curves || !adv->grouped || !adv->groups)
+        return ENOMEM;
+
+    for (size_t k = 0; k < job->nkeys; k++) {
+        const db_key_t *key = job->keys[k];
+        signer_t *s = &adv->signers[adv->nsigners++];
+        size_t c = 0;
+
+        s->fp = fingerprint(key->nid, key->pub, key->publen);
+        s->grp = key->nid;
+        s->pub = job->gkeys[k]->key;
+
+        for (size_t h = 0; h < job->nhashes; h++) {
+            for (size_t t = 0; t < NSUPPORTED; t++) {
+                if (supported[t].sign == job->hashes[h].sign)
+                    s->sigs[t] = job->sigs[h * job->nkeys + k]->sig;
+            }
+        }
+
+        if (!key->adv)
+            continue;
+
+        while (c < adv->ncurves && adv->curves[c] < key->nid)
+            c++;
+
+        if (c < adv->ncurves && adv->curves[c] == key->nid)
+            continue;
+
+        memmove(&adv->curves[c + 1], &adv->curves[c],
+                (adv->ncurves - c) * sizeof(*adv->curves));
+        adv->curves[c] = key->nid;
+        adv->ncurves++;
+    }
+
+    qsort(adv->signers, adv->nsigners, sizeof(*adv->signers), cmp_signer);
+
+    for (size_t h = 0; h < job->nhashes; h++) {
+        for (size_t c = 0; c < adv->ncurves; c++) {
+            group_t *g = &adv->groups[adv->ngroups];
+
+            g->first = n;
+            g->curve = c;
+            for (size_t t = 0; t < NSUPPORTED; t++) {
+                if (supported[t].sign == job->hashes[h].sign)
+                    g->type = t;
+            }
+
+            for (size_t k = 0; k < job->nkeys; k++) {
+                if (job->keys[k]->adv && job->keys[k]->nid == adv->curves[c])
+                    adv->grouped[n++] = job->sigs[h * job->nkeys + k]->sig;
+            }
+
+            g->count = n - g->first;
+            if (g->count > 0)
+                adv->ngroups++;
+        }
+    }
+
+    return 0;
+}
+
+static cache_t *
+cache_new(void)
+{
+    cache_t *cache = NULL;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static void
+cache_free(cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    for (size_t i = 0; i < ADV_CACHE; i++)
+        free(cache->entries[i]);
+
+    for (size_t i = 0; i < cache->ndead; i++)
+        free(cache->dead[i]);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
 }
 
 int
@@ -144,13 +693,18 @@ adv_init(adv_t **adv)
         return ENOMEM;
 
     tmp->sigs = calloc(1, sizeof(*tmp->sigs));
-    if (!tmp->sigs)
+    tmp->keys = calloc(1, sizeof(*tmp->keys));
+    if (!tmp->sigs || !tmp->keys)
         goto error;
 
     tmp->rep = TANG_MSG_ADV_REP_new();
     if (!tmp->rep)
         goto error;
 
+    tmp->cache = cache_new();
+    if (!tmp->cache)
+        goto error;
+
     *adv = tmp;
     return 0;
 
@@ -166,9 +720,21 @@ adv_free_contents(adv_t *adv)
         return;
 
     TANG_MSG_ADV_REP_free(adv->rep);
-    for (size_t i = 0; adv->sigs && adv->sigs[i]; i++)
+    OPENSSL_free(adv->body);
+    free(adv->grouped);
+    free(adv->groups);
+    free(adv->curves);
+    free(adv->signers);
+
+    for (size_t i = 0; i < adv->nsigs; i++)
         sig_free(adv->sigs[i]);
     free(adv->sigs);
+
+    for (size_t i = 0; i < adv->nkeys; i++)
+        TANG_KEY_free(adv->keys[i]);
+    free(adv->keys);
+
+    cache_free(adv->cache);
 }
 
 void
@@ -178,28 +744,42 @@ adv_free(adv_t *adv)
     free(adv);
 }
 
-int
-adv_update(adv_t *adv, const db_t *db, BN_CTX *ctx)
+/* Makes the advertisement for db. Signatures come from sigs, in the cache's
+ * format, if given; otherwise from the cache file, signing what it lacks. */
+static int
+update(adv_t *adv, const db_t *db, const unsigned char *sigs, size_t slen)
 {
     unsigned char *buf = NULL;
     size_t nkeys = 0;
     adv_t tmp = {};
+    job_t job = {};
     int len = 0;
     int r = 0;
 
     /* Create the new reply structure. */
-    LIST_FOREACH(&db->keys, db_key_t, k, list)
-        nkeys++;
-    nkeys *= sizeof(supported) / sizeof(*supported);
-    tmp.sigs = calloc(nkeys + 1, sizeof(*tmp.sigs));
+    for (size_t i = 0; i < db->nkeys; i++) {
+        if (db->keys[i].use == TANG_KEY_USE_SIG)
+            nkeys++;
+    }
+
+    job.keys = calloc(nkeys + 1, sizeof(*job.keys));
+    tmp.keys = calloc(nkeys + 1, sizeof(*tmp.keys));
+    tmp.sigs = calloc(nkeys * NSUPPORTED + 1, sizeof(*tmp.sigs));
+    tmp.nkeys = tmp.keys ? nkeys : 0;
+    tmp.nsigs = tmp.sigs ? nkeys * NSUPPORTED : 0;
     tmp.rep = TANG_MSG_ADV_REP_new();
-    if (!tmp.sigs || !tmp.rep)
+    tmp.cache = cache_new();
+    if (!job.keys || !tmp.keys || !tmp.sigs || !tmp.rep || !tmp.cache)
         goto error;
 
     /* Create the reply body from the loaded keys. */
-    LIST_FOREACH(&db->keys, db_key_t, k, list) {
+    for (size_t i = 0; i < db->nkeys; i++) {
+        const db_key_t *k = &db->keys[i];
         TANG_KEY *key = NULL;
 
+        if (k->use == TANG_KEY_USE_SIG)
+            job.keys[job.nkeys++] = k;
+
         if (!k->adv)
             continue;
 
@@ -212,7 +792,7 @@ adv_update(adv_t *adv, const db_t *db, BN_CTX *ctx)
             goto error;
         }
 
-        if (conv_eckey2gkey(k->key, k->use, key, ctx) != 0)
+        if (make_key(k, key) != 0)
             goto error;
     }
 
@@ -221,79 +801,363 @@ adv_update(adv_t *adv, const db_t *db, BN_CTX *ctx)
     if (len <= 0)
         goto error;
 
-    /* Create all signature combinations. */
-    nkeys = 0;
-    for (size_t i = 0; i < sizeof(supported) / sizeof(*supported); i++) {
-        unsigned char hash[EVP_MAX_MD_SIZE] = {};
-        unsigned int hlen = sizeof(hash);
+    /* Hash it once per supported digest. */
+    for (size_t i = 0; i < NSUPPORTED; i++) {
+        typeof(*job.hashes) *h = &job.hashes[job.nhashes];
         const EVP_MD *md = NULL;
 
         md = EVP_get_digestbynid(supported[i].hash);
         if (!md)
             continue;
 
-        if (EVP_Digest(buf, len, hash, &hlen, md, NULL) <= 0)
+        h->len = sizeof(h->buf);
+        if (EVP_Digest(buf, len, h->buf, &h->len, md, NULL) <= 0)
             goto error;
 
-        LIST_FOREACH(&db->keys, db_key_t, k, list) {
-            if (k->use != TANG_KEY_USE_SIG)
-                continue;
+        h->sign = supported[i].sign;
+        job.nhashes++;
+    }
+
+    /* Create all signature combinations, reusing any from a previous run.
+     * Given signatures must be complete, so that nothing is signed here. */
+    job.gkeys = tmp.keys;
+    job.sigs = tmp.sigs;
+    if (sigs) {
+        if (!parse(sigs, slen, buf, len, &job)) {
+            r = EINVAL;
+            goto error;
+        }
 
-            tmp.sigs[nkeys] = make_sig(supported[i].sign, k, hash, hlen, ctx);
-            if (!tmp.sigs[nkeys++])
+        for (size_t i = 0; i < job.nhashes * job.nkeys; i++) {
+            if (!job.sigs[i]) {
+                r = EINVAL;
                 goto error;
+            }
         }
+    } else {
+        cache_load(db, buf, len, &job);
     }
 
+    r = sign_all(&job);
+    if (r != 0)
+        goto error;
+
+    r = index_build(&tmp, &job);
+    if (r != 0)
+        goto error;
+
+    tmp.body = buf;
+    tmp.blen = len;
+    tmp.fresh = job.nfresh > 0;
+
     /* Clean up. */
     adv_free_contents(adv);
-    OPENSSL_free(buf);
+    free(job.keys);
     *adv = tmp;
     return 0;
 
 error:
     OPENSSL_free(buf);
+    free(job.keys);
     adv_free_contents(&tmp);
     return r == 0 ? ENOMEM : r;
 }
 
-TANG_MSG_ERR
-adv_sign(adv_t *adv, const TANG_MSG_ADV_REQ *req, pkt_t *pkt)
+int
+adv_update(adv_t *adv, const db_t *db)
+{
+    return update(adv, db, NULL, 0);
+}
+
+void
+adv_cache(const adv_t *adv, const db_t *db)
+{
+    if (adv->fresh)
+        cache_save(db, adv);
+}
+
+size_t
+adv_save(const adv_t *adv, unsigned char *buf, size_t max)
+{
+    return save(adv, buf, max);
+}
+
+int
+adv_load(adv_t *adv, const db_t *db, const unsigned char *buf, size_t len)
+{
+    return update(adv, db, buf, len);
+}
+
+static bool
+put(unsigned char *buf, size_t *off, size_t max, const void *data, size_t len)
+{
+    if (len > max - *off)
+        return false;
+
+    memcpy(&buf[*off], data, len);
+    *off += len;
+    return true;
+}
+
+static bool
+put_set(unsigned char *buf, size_t *off, size_t max, const pkt_set_t *set)
+{
+    return put(buf, off, max, &set->restricted, sizeof(set->restricted))
+        && put(buf, off, max, &set->n, sizeof(set->n))
+        && put(buf, off, max, set->nids, set->n * sizeof(*set->nids));
+}
+
+/* Writes the part of a request that determines its answer. Requests that
+ * normalize to the same filter always get the same reply. Returns zero if
+ * the filter is too large to cache. */
+static size_t
+filter(const pkt_adv_t *req, unsigned char *buf, size_t max)
+{
+    size_t off = 0;
+
+    if (!put(buf, &off, max, &req->key, sizeof(req->key)) ||
+        !put_set(buf, &off, max, &req->types))
+        return 0;
+
+    if (!req->key)
+        return put_set(buf, &off, max, &req->grps) ? off : 0;
+
+    if (!put(buf, &off, max, &req->grp, sizeof(req->grp)) ||
+        !put(buf, &off, max, req->pub, req->publen))
+        return 0;
+
+    return off;
+}
+
+/* Marks which of nids a set allows: all of them if it restricts nothing,
+ * otherwise those it names. Sets are small, so this costs little. */
+static void
+allowed(const pkt_set_t *set, const int *nids, size_t n, bool *out)
 {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = !set->restricted;
+
+        for (size_t j = 0; !out[i] && j < set->n; j++)
+            out[i] = set->nids[j] == nids[i];
+    }
+}
+
+static const signer_t *
+find_signer(const adv_t *adv, const pkt_adv_t *req)
+{
+    size_t lo = 0;
+    size_t hi = adv->nsigners;
+    uint32_t fp;
+
+    if (req->grp == NID_undef)
+        return NULL;
+
+    fp = fingerprint(req->grp, req->pub, req->publen);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (adv->signers[mid].fp < fp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < adv->nsigners && adv->signers[lo].fp == fp; lo++) {
+        const signer_t *s = &adv->signers[lo];
+
+        if (s->grp == req->grp && (size_t) s->pub->length == req->publen &&
+            memcmp(s->pub->data, req->pub, req->publen) == 0)
+            return s;
+    }
+
+    return NULL;
+}
+
+static bool
+push(STACK_OF(TANG_SIG) *sigs, TANG_SIG *sig)
+{
+    return SKM_sk_push(TANG_SIG, sigs, sig) > 0;
+}
+
+static TANG_MSG_ERR
+sign(const adv_t *adv, const pkt_adv_t *req, pkt_t *pkt)
+{
+    TANG_MSG_ADV_REP rep = { .body = adv->rep->body };
+    bool curves[adv->ncurves + 1];
+    bool types[NSUPPORTED];
+    int signs[NSUPPORTED];
     int r;
 
-    /* Select the key used for the signature. */
-    for (size_t i = 0; adv->sigs[i]; i++) {
-        if (req->body->type == TANG_MSG_ADV_REQ_BDY_TYPE_KEY) {
-            if (!TANG_KEY_equals(req->body->val.key, adv->sigs[i]->key))
-                continue;
-        } else if (!adv->sigs[i]->adv) {
-            continue;
+    /* The reply is assembled locally so that workers can share adv. */
+    rep.sigs = SKM_sk_new_null(TANG_SIG);
+    if (!rep.sigs)
+        return TANG_MSG_ERR_INTERNAL;
+
+    /* Resolve the filters once, then select by index. */
+    for (size_t i = 0; i < NSUPPORTED; i++)
+        signs[i] = supported[i].sign;
+    allowed(&req->types, signs, NSUPPORTED, types);
+
+    if (req->key) {
+        const signer_t *s = find_signer(adv, req);
+
+        for (size_t i = 0; s && i < NSUPPORTED; i++) {
+            if (types[i] && s->sigs[i] && !push(rep.sigs, s->sigs[i]))
+                goto error;
         }
+    } else {
+        allowed(&req->grps, adv->curves, adv->ncurves, curves);
 
-        if (req->body->type == TANG_MSG_ADV_REQ_BDY_TYPE_GRPS &&
-            !has_object(adv->sigs[i]->key->grp, req->body->val.grps))
-            continue;
+        for (size_t i = 0; i < adv->ngroups; i++) {
+            const group_t *g = &adv->groups[i];
 
-        if (!has_object(adv->sigs[i]->sig->type, req->types))
-            continue;
+            if (!types[g->type] || !curves[g->curve])
+                continue;
 
-        if (SKM_sk_push(TANG_SIG, adv->rep->sigs, adv->sigs[i]->sig) <= 0) {
-            SKM_sk_zero(TANG_SIG, adv->rep->sigs);
-            return TANG_MSG_ERR_INTERNAL;
+            for (size_t j = 0; j < g->count; j++) {
+                if (!push(rep.sigs, adv->grouped[g->first + j]))
+                    goto error;
+            }
         }
     }
 
     /* If no matching keys were found, error. */
-    if (SKM_sk_num(TANG_SIG, adv->rep->sigs) == 0)
+    if (SKM_sk_num(TANG_SIG, rep.sigs) == 0) {
+        SKM_sk_free(TANG_SIG, rep.sigs);
         return TANG_MSG_ERR_NOTFOUND_KEY;
+    }
 
     /* Encode the output. */
     r = pkt_encode((ASN1_VALUE *) &(TANG_MSG) {
         .type = TANG_MSG_TYPE_ADV_REP,
-        .val.adv.rep = adv->rep
+        .val.adv.rep = &rep
     }, &TANG_MSG_it, pkt);
 
-    SKM_sk_zero(TANG_SIG, adv->rep->sigs);
+    SKM_sk_free(TANG_SIG, rep.sigs);
     return r == 0 ? TANG_MSG_ERR_NONE : TANG_MSG_ERR_INTERNAL;
+
+error:
+    SKM_sk_free(TANG_SIG, rep.sigs);
+    return TANG_MSG_ERR_INTERNAL;
+}
+
+/* Publishes an entry in its set, in place of one that has not been hit
+ * lately. Returns false if it was not published. */
+static bool
+publish(cache_t *cache, entry_t *e)
+{
+    entry_t **set = &cache->entries[e->hash % NSETS * ADV_WAYS];
+    uint8_t *hand = &cache->hands[e->hash % NSETS];
+    bool done = false;
+    entry_t *old;
+
+    pthread_mutex_lock(&cache->lock);
+
+    /* Another worker may have got there first. */
+    for (size_t i = 0; i < ADV_WAYS; i++) {
+        old = set[i];
+        if (old && old->hash == e->hash && old->flen == e->flen &&
+            memcmp(old->data, e->data, e->flen) == 0)
+            goto egress;
+    }
+
+    /* Entries that are in use get a second chance. */
+    for (size_t i = 0; i < ADV_WAYS * 2; i++, *hand = (*hand + 1) % ADV_WAYS) {
+        old = set[*hand];
+        if (old && __atomic_exchange_n(&old->used, false, __ATOMIC_RELAXED))
+            continue;
+
+        /* Until a grace period frees them, replaced entries are bounded. */
+        if (old && cache->ndead == ADV_RETIRED)
+            break;
+
+        if (old)
+            cache->dead[cache->ndead++] = old;
+
+        __atomic_store_n(&set[*hand], e, __ATOMIC_RELEASE);
+        *hand = (*hand + 1) % ADV_WAYS;
+        done = true;
+        break;
+    }
+
+egress:
+    pthread_mutex_unlock(&cache->lock);
+    return done;
+}
+
+TANG_MSG_ERR
+adv_sign(const adv_t *adv, const pkt_adv_t *req, pkt_t *pkt)
+{
+    unsigned char key[ADV_FILTER];
+    entry_t **set = NULL;
+    entry_t *e = NULL;
+    TANG_MSG_ERR err;
+    size_t flen;
+    uint32_t h;
+
+    flen = filter(req, key, sizeof(key));
+    if (flen == 0)
+        return sign(adv, req, pkt);
+
+    /* Entries are immutable once published, so readers need no lock. The
+     * reply is sent straight from the entry. */
+    h = hash(key, flen);
+    set = &adv->cache->entries[h % NSETS * ADV_WAYS];
+    for (size_t i = 0; i < ADV_WAYS; i++) {
+        e = __atomic_load_n(&set[i], __ATOMIC_ACQUIRE);
+        if (!e || e->hash != h || e->flen != flen ||
+            memcmp(e->data, key, flen) != 0)
+            continue;
+
+        if (!__atomic_load_n(&e->used, __ATOMIC_RELAXED))
+            __atomic_store_n(&e->used, true, __ATOMIC_RELAXED);
+
+        if (e->err != TANG_MSG_ERR_NONE)
+            return e->err;
+
+        pkt_view(pkt, &e->data[flen], e->rlen);
+        return TANG_MSG_ERR_NONE;
+    }
+
+    err = sign(adv, req, pkt);
+    if (err != TANG_MSG_ERR_NONE && err != TANG_MSG_ERR_NOTFOUND_KEY)
+        return err;
+
+    /* Requests can name any number of keys we don't have: don't let them
+     * push out the answers that matter. */
+    if (err == TANG_MSG_ERR_NOTFOUND_KEY && req->key)
+        return err;
+
+    e = malloc(sizeof(*e) + flen + (err == TANG_MSG_ERR_NONE ? pkt->size : 0));
+    if (!e)
+        return err;
+
+    e->hash = h;
+    e->used = false;
+    e->flen = flen;
+    e->rlen = err == TANG_MSG_ERR_NONE ? pkt->size : 0;
+    e->err = err;
+    memcpy(e->data, key, flen);
+    memcpy(&e->data[flen], pkt->data, e->rlen);
+
+    if (!publish(adv->cache, e))
+        free(e);
+
+    return err;
+}
+
+size_t
+adv_retired(const adv_t *adv, void **dead, size_t max)
+{
+    cache_t *cache = adv->cache;
+    size_t n = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    n = cache->ndead < max ? cache->ndead : max;
+    cache->ndead -= n;
+    memcpy(dead, &cache->dead[cache->ndead], n * sizeof(*dead));
+
+    pthread_mutex_unlock(&cache->lock);
+    return n;
 }
@@ -30,7 +30,30 @@ void
 adv_free(adv_t *adv);
 
 int
-adv_update(adv_t *adv, const db_t *db, BN_CTX *ctx);
+adv_update(adv_t *adv, const db_t *db);
 
+/* Writes the signatures adv_update() made to the cache in the key directory,
+ * if it made any. This syncs the file, so call it once the advertisement is
+ * being served: only the next start reads it. */
+void
+adv_cache(const adv_t *adv, const db_t *db);
+
+/* Writes the body and signatures of the advertisement to buf if they fit in
+ * max bytes. Returns the number of bytes they take either way. */
+size_t
+adv_save(const adv_t *adv, unsigned char *buf, size_t max);
+
+/* Like adv_update(), but with the signatures that adv_save() wrote for the
+ * same keys. Never signs: fails with EINVAL if any signature is missing. */
+int
+adv_load(adv_t *adv, const db_t *db, const unsigned char *buf, size_t len);
+
+/* Answers an advertisement request. Repeated requests are answered from a
+ * cache, and then pkt merely views the reply within adv. */
 TANG_MSG_ERR
-adv_sign(adv_t *adv, const TANG_MSG_ADV_REQ *req, pkt_t *pkt);
+adv_sign(const adv_t *adv, const pkt_adv_t *req, pkt_t *pkt);
+
+/* Takes up to max cache entries that have been replaced, but that replies
+ * being sent may still view. Free them once nobody can be. */
+size_t
+adv_retired(const adv_t *adv, void **dead, size_t max);
@@ -17,41 +17,157 @@
  */
 
 #include "db.h"
+#include "idx.h"
+#include "../grp.h"
+#include "../mem.h"
 
 #include <openssl/pem.h>
 
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #define MIN(a, b) \
     ({ typeof(a) __a = a; typeof(a) __b = b; __a > __b ? __b : __a; })
 
+#define DB_SLOTS 16         /* Fewest slots in the index. */
+#define DB_POINT 133        /* An uncompressed secp521r1 point. */
+#define DB_EVENTS 64        /* Most events read at once. */
+#define DB_THREADS 16       /* Most threads used to read keys at startup. */
+#define DB_PER_THREAD 8     /* Fewest keys worth starting a thread for. */
+
+static db_file_t *
+new_file(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    db_file_t *file = NULL;
+
+    if (nlen >= NAME_MAX || dlen + nlen + 1 >= PATH_MAX) {
+        errno = E2BIG;
+        return NULL;
+    }
+
+    file = calloc(1, sizeof(*file));
+    if (!file)
+        return NULL;
+
+    file->path = malloc(dlen + nlen + 2);
+    if (!file->path) {
+        free(file);
+        return NULL;
+    }
+
+    memcpy(file->path, dir, dlen);
+    file->path[dlen] = '/';
+    memcpy(&file->path[dlen + 1], name, nlen + 1);
+    file->name = &file->path[dlen + 1];
+    file->refs = 1;
+    return file;
+}
+
 static void
-db_key_free(db_key_t *key)
+file_free(db_file_t *file)
 {
-    if (!key)
+    if (!file || __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0)
         return;
 
-    EC_KEY_free(key->key);
-    free(key);
+    EC_KEY_free(file->key);
+    free(file->path);
+    free(file->pub);
+    free(file);
+}
+
+/* FNV-1a over the curve and the point. */
+static uint32_t
+hash(int nid, const unsigned char *pub, size_t publen)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(nid); i++)
+        h = (h ^ ((unsigned) nid >> (i * 8) & 0xff)) * 16777619u;
+
+    for (size_t i = 0; i < publen; i++)
+        h = (h ^ pub[i]) * 16777619u;
+
+    return h;
+}
+
+/* Rebuilds the index, with at most half of its slots in use. If memory runs
+ * out, the index is left empty, so that nothing is found rather than the
+ * wrong key. */
+static int
+index_build(db_t *db)
+{
+    size_t nslots = DB_SLOTS;
+
+    while (nslots < db->nkeys * 2)
+        nslots *= 2;
+
+    free(db->slots);
+    db->nslots = 0;
+    db->slots = calloc(nslots, sizeof(*db->slots));
+    if (!db->slots)
+        return ENOMEM;
+
+    db->nslots = nslots;
+    for (size_t i = 0; i < db->nkeys; i++) {
+        size_t s = db->keys[i].hash & (nslots - 1);
+
+        while (db->slots[s] != 0)
+            s = (s + 1) & (nslots - 1);
+
+        db->slots[s] = i + 1;
+    }
+
+    return 0;
+}
+
+static int
+cmp_key(const void *a, const void *b)
+{
+    const db_key_t *x = a;
+    const db_key_t *y = b;
+
+    return strcmp(x->file->name, y->file->name);
+}
+
+static int
+cmp_name(const void *name, const void *key)
+{
+    return strcmp(name, ((const db_key_t *) key)->file->name);
+}
+
+static db_key_t *
+find_name(const db_t *db, const char *name)
+{
+    if (db->nkeys == 0)
+        return NULL;
+
+    return bsearch(name, db->keys, db->nkeys, sizeof(*db->keys), cmp_name);
 }
 
+/* Reads the attributes of the key's file. The change time is taken first,
+ * so that any later change is sure to be seen by a rescan. */
 static int
-load_attrs(db_t *db, db_key_t *key)
+load_attrs(db_key_t *key)
 {
-    char path[PATH_MAX+1];
+    const char *path = key->file->path;
     char attr[NAME_MAX];
+    struct stat st;
     int r;
 
-    r = snprintf(path, sizeof(path), "%s/%s", db->path, key->name);
-    if (r >= (typeof(r)) sizeof(path)) return E2BIG;
-    if (r < 0) return errno;
+    if (stat(path, &st) != 0)
+        return errno;
+    key->file->ctime = st.st_ctim;
 
     key->adv = false;
     r = getxattr(path, "user.tang.adv", attr, sizeof(attr));
@@ -70,81 +186,234 @@ load_attrs(db_t *db, db_key_t *key)
     return 0;
 }
 
-static int
-load(db_t *db, const char *name)
+static EC_KEY *
+read_pem(const char *path)
 {
-    char path[PATH_MAX+1];
     EC_GROUP *grp = NULL;
-    db_key_t *key = NULL;
+    EC_KEY *key = NULL;
     FILE *file = NULL;
-    ssize_t r;
 
-    r = snprintf(path, sizeof(path), "%s/%s", db->path, name);
-    if (r >= (typeof(r)) sizeof(path)) return E2BIG;
-    if (r < 0) return errno;
+    file = fopen(path, "r");
+    if (!file)
+        return NULL;
 
-    key = calloc(1, sizeof(*key));
-    if (!key)
-        return errno;
+    grp = PEM_read_ECPKParameters(file, NULL, NULL, NULL);
+    if (grp && EC_GROUP_get_curve_name(grp) != NID_undef)
+        key = PEM_read_ECPrivateKey(file, NULL, NULL, NULL);
 
-    if (strlen(name) >= sizeof(key->name)) {
-        db_key_free(key);
-        return E2BIG;
+    if (key && EC_KEY_set_group(key, grp) <= 0) {
+        EC_KEY_free(key);
+        key = NULL;
     }
-    strncpy(key->name, name, sizeof(key->name));
 
-    file = fopen(path, "r");
-    if (!file) {
-        db_key_free(key);
-        return errno;
-    }
+    EC_GROUP_free(grp);
+    fclose(file);
+    return key;
+}
 
-    grp = PEM_read_ECPKParameters(file, NULL, NULL, NULL);
-    if (!grp || EC_GROUP_get_curve_name(grp) == NID_undef) {
-        EC_GROUP_free(grp);
-        db_key_free(key);
-        fclose(file);
+/* Encodes a point uncompressed. Returns its length, or zero on failure. */
+static size_t
+encode(const EC_GROUP *grp, const EC_POINT *p, unsigned char buf[DB_POINT])
+{
+    return EC_POINT_point2oct(grp, p, POINT_CONVERSION_UNCOMPRESSED,
+                              buf, DB_POINT, NULL);
+}
+
+/* Sets the public point of key, which its file keeps. */
+static int
+set_pub(db_key_t *key, const unsigned char *pub, size_t publen)
+{
+    if (publen == 0 || publen > DB_POINT)
         return EINVAL;
-    }
 
-    key->key = PEM_read_ECPrivateKey(file, NULL, NULL, NULL);
-    fclose(file);
-    if (!key->key) {
-        EC_GROUP_free(grp);
-        db_key_free(key);
+    key->file->pub = malloc(publen);
+    if (!key->file->pub)
+        return ENOMEM;
+
+    memcpy(key->file->pub, pub, publen);
+    key->pub = key->file->pub;
+    key->publen = publen;
+    key->hash = hash(key->nid, key->pub, key->publen);
+    return 0;
+}
+
+/* Reads what the server needs to know about the key in a file: its
+ * attributes, curve and public point. These come from the index if it is up
+ * to date and from PEM otherwise; either way, the private key is left for
+ * db_key_get(). Touches nothing but key, so keys can be read in parallel. */
+static int
+read_key(const idx_t *idx, db_key_t *key)
+{
+    db_file_t *file = key->file;
+    unsigned char buf[DB_POINT];
+    const unsigned char *pub = NULL;
+    const EC_GROUP *grp = NULL;
+    size_t publen = 0;
+    EC_KEY *ec = NULL;
+    struct stat st;
+    int r;
+
+    if (stat(file->path, &st) != 0)
+        return errno;
+
+    file->ino = st.st_ino;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim;
+    file->ctime = st.st_ctim;
+
+    if (idx && idx_load(idx, file->name, &st, &key->nid, &pub, &publen,
+                        &key->use, &key->adv))
+        return set_pub(key, pub, publen);
+
+    ec = read_pem(file->path);
+    if (!ec)
         return EINVAL;
+
+    grp = EC_KEY_get0_group(ec);
+    key->nid = EC_GROUP_get_curve_name(grp);
+    publen = EC_KEY_get0_public_key(ec)
+           ? encode(grp, EC_KEY_get0_public_key(ec), buf) : 0;
+    EC_KEY_free(ec);
+
+    r = set_pub(key, buf, publen);
+    if (r != 0)
+        return r;
+
+    return load_attrs(key);
+}
+
+/* Reads the key in the named file into key, which gets its own file. */
+static int
+load(const db_t *db, const idx_t *idx, const char *name, db_key_t *key)
+{
+    int r;
+
+    *key = (db_key_t) { .file = new_file(db->path, name) };
+    if (!key->file)
+        return errno;
+
+    r = read_key(idx, key);
+    if (r != 0) {
+        file_free(key->file);
+        key->file = NULL;
     }
 
-    if (EC_KEY_set_group(key->key, grp) <= 0) {
-        EC_GROUP_free(grp);
-        db_key_free(key);
-        return EINVAL;
+    return r;
+}
+
+/* Keys read at startup. Threads take them one at a time. */
+typedef struct {
+    const idx_t *idx;
+    db_key_t *keys;
+    int *errs;
+    size_t nkeys;
+    size_t next;
+} job_t;
+
+static void
+run(job_t *job)
+{
+    for (size_t i; (i = __atomic_fetch_add(&job->next, 1,
+                                           __ATOMIC_RELAXED)) < job->nkeys; )
+        job->errs[i] = read_key(job->idx, &job->keys[i]);
+}
+
+static void *
+reader(void *arg)
+{
+    run(arg);
+    mem_flush();
+    return NULL;
+}
+
+static void
+read_all(job_t *job)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t thrs[DB_THREADS];
+    size_t nthrs = 0;
+
+    if (ncpus < 1)
+        ncpus = 1;
+    else if (ncpus > DB_THREADS)
+        ncpus = DB_THREADS;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    /* Without locking callbacks, libcrypto may only be used by one thread. */
+    if (!CRYPTO_get_locking_callback())
+        ncpus = 1;
+#endif
+
+    while (nthrs + 1 < (size_t) ncpus &&
+           (nthrs + 1) * DB_PER_THREAD < job->nkeys) {
+        if (pthread_create(&thrs[nthrs], NULL, reader, job) != 0)
+            break;
+        nthrs++;
     }
-    EC_GROUP_free(grp);
 
-    r = load_attrs(db, key);
-    if (r != 0) {
-        db_key_free(key);
-        return r;
+    run(job);
+
+    for (size_t i = 0; i < nthrs; i++)
+        pthread_join(thrs[i], NULL);
+}
+
+/* Lists the key files in the directory, without reading them yet. */
+static int
+list_dir(const db_t *db, job_t *job)
+{
+    size_t max = 0;
+    DIR *dir = NULL;
+    int r = 0;
+
+    dir = opendir(db->path);
+    if (!dir)
+        return errno;
+
+    for (struct dirent *de = readdir(dir); de; de = readdir(dir)) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        if (job->nkeys == max) {
+            db_key_t *keys = NULL;
+
+            max = max > 0 ? max * 2 : 64;
+            keys = realloc(job->keys, max * sizeof(*keys));
+            if (!keys) {
+                r = ENOMEM;
+                break;
+            }
+
+            job->keys = keys;
+        }
+
+        job->keys[job->nkeys] = (db_key_t) {
+            .file = new_file(db->path, de->d_name)
+        };
+        if (!job->keys[job->nkeys].file) {
+            fprintf(stderr, "Skipping key %s: %s\n",
+                    de->d_name, strerror(errno));
+            continue;
+        }
+
+        job->nkeys++;
     }
 
-    list_add_after(&db->keys, &key->list);
-    return 0;
+    closedir(dir);
+    return r;
 }
 
 int
 db_open(const char *dbdir, db_t **db)
 {
     db_t *tmp = NULL;
-    DIR *dir = NULL;
+    idx_t *idx = NULL;
+    job_t job = {};
     int r;
 
     tmp = calloc(1, sizeof(*tmp));
     if (tmp == NULL)
         return errno;
 
-    tmp->keys = LIST_INIT(tmp->keys);
-
     if (strlen(dbdir) >= sizeof(tmp->path)) {
         db_free(tmp);
         return E2BIG;
@@ -164,26 +433,219 @@ db_open(const char *dbdir, db_t **db)
         return errno;
     }
 
-    dir = opendir(tmp->path);
-    if (!dir) {
-        db_free(tmp);
-        return errno;
+    r = list_dir(tmp, &job);
+    if (r != 0)
+        goto egress;
+
+    job.errs = calloc(job.nkeys, sizeof(*job.errs));
+    if (job.nkeys > 0 && !job.errs) {
+        r = ENOMEM;
+        goto egress;
     }
 
-    for (struct dirent *de = readdir(dir); de; de = readdir(dir)) {
-        if (de->d_name[0] == '.')
+    /* The index is optional; without it, every key is read from PEM. */
+    idx_open(tmp->path, &idx);
+
+    job.idx = idx;
+    read_all(&job);
+
+    /* Keep the keys that were read. A bad file shouldn't stop the server,
+     * so it is reported and left out. */
+    for (size_t i = 0; i < job.nkeys; i++) {
+        if (job.errs[i] == 0) {
+            job.keys[tmp->nkeys++] = job.keys[i];
             continue;
+        }
+
+        if (job.errs[i] == ENOMEM)
+            r = ENOMEM;
+        else if (job.errs[i] != ENOENT)
+            fprintf(stderr, "Skipping key %s: %s\n",
+                    job.keys[i].file->name, strerror(job.errs[i]));
+
+        file_free(job.keys[i].file);
+    }
+
+    job.nkeys = 0;
+    tmp->keys = job.keys;
+    job.keys = NULL;
+    if (r != 0)
+        goto egress;
+
+    if (tmp->nkeys > 0)
+        qsort(tmp->keys, tmp->nkeys, sizeof(*tmp->keys), cmp_key);
+    r = index_build(tmp);
+
+egress:
+    for (size_t i = 0; i < job.nkeys; i++)
+        file_free(job.keys[i].file);
+
+    free(job.keys);
+    free(job.errs);
+    idx_free(idx);
+
+    if (r != 0) {
+        db_free(tmp);
+        return r;
+    }
+
+    *db = tmp;
+    return 0;
+}
 
-        r = load(tmp, de->d_name);
-        if (r != 0) {
-            closedir(dir);
-            db_free(tmp);
-            return r;
+int
+db_copy(const db_t *db, db_t **copy)
+{
+    db_t *tmp = NULL;
+
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp)
+        return ENOMEM;
+
+    strcpy(tmp->path, db->path);
+    tmp->fd = -1;
+
+    tmp->keys = calloc(db->nkeys + 1, sizeof(*tmp->keys));
+    tmp->slots = calloc(db->nslots + 1, sizeof(*tmp->slots));
+    if (!tmp->keys || !tmp->slots) {
+        db_free(tmp);
+        return ENOMEM;
+    }
+
+    /* The records are copied; the files behind them are shared. */
+    for (size_t i = 0; i < db->nkeys; i++) {
+        tmp->keys[i] = db->keys[i];
+        __atomic_add_fetch(&tmp->keys[i].file->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    memcpy(tmp->slots, db->slots, db->nslots * sizeof(*tmp->slots));
+    tmp->nkeys = db->nkeys;
+    tmp->nslots = db->nslots;
+
+    *copy = tmp;
+    return 0;
+}
+
+/* A key as db_save() writes it, followed by its name and public point. */
+typedef struct {
+    int32_t nid;
+    uint8_t use;
+    uint8_t adv;
+    uint8_t namelen;
+    uint8_t publen;
+} rec_t;
+
+size_t
+db_save(const db_t *db, unsigned char *buf, size_t max)
+{
+    size_t len = 0;
+
+    for (size_t i = 0; i < db->nkeys; i++) {
+        const db_key_t *key = &db->keys[i];
+        rec_t rec = {
+            .nid = key->nid,
+            .use = key->use,
+            .adv = key->adv,
+            .namelen = strlen(key->file->name),
+            .publen = key->publen,
+        };
+        size_t size = sizeof(rec) + rec.namelen + rec.publen;
+
+        if (len + size <= max) {
+            memcpy(&buf[len], &rec, sizeof(rec));
+            memcpy(&buf[len + sizeof(rec)], key->file->name, rec.namelen);
+            memcpy(&buf[len + sizeof(rec) + rec.namelen],
+                   key->pub, rec.publen);
+        }
+
+        len += size;
+    }
+
+    return len;
+}
+
+int
+db_load(const char *dbdir, const unsigned char *buf, size_t len, db_t **db)
+{
+    char name[NAME_MAX];
+    db_t *tmp = NULL;
+    size_t max = 0;
+    int r = 0;
+
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp)
+        return ENOMEM;
+
+    tmp->fd = -1;
+    if (strlen(dbdir) >= sizeof(tmp->path)) {
+        db_free(tmp);
+        return E2BIG;
+    }
+    strcpy(tmp->path, dbdir);
+
+    for (size_t off = 0; off < len; ) {
+        db_key_t *key = NULL;
+        rec_t rec;
+
+        if (len - off < sizeof(rec)) {
+            r = EINVAL;
+            break;
+        }
+
+        memcpy(&rec, &buf[off], sizeof(rec));
+        off += sizeof(rec);
+        if (len - off < (size_t) rec.namelen + rec.publen ||
+            rec.namelen >= sizeof(name)) {
+            r = EINVAL;
+            break;
         }
+
+        if (tmp->nkeys == max) {
+            db_key_t *keys = NULL;
+
+            max = max > 0 ? max * 2 : 64;
+            keys = realloc(tmp->keys, max * sizeof(*keys));
+            if (!keys) {
+                r = ENOMEM;
+                break;
+            }
+
+            tmp->keys = keys;
+        }
+
+        memcpy(name, &buf[off], rec.namelen);
+        name[rec.namelen] = '\0';
+        off += rec.namelen;
+
+        key = &tmp->keys[tmp->nkeys];
+        *key = (db_key_t) {
+            .file = new_file(tmp->path, name),
+            .nid = rec.nid,
+            .use = rec.use,
+            .adv = rec.adv,
+        };
+        if (!key->file) {
+            r = errno;
+            break;
+        }
+
+        r = set_pub(key, &buf[off], rec.publen);
+        off += rec.publen;
+        tmp->nkeys++;
+        if (r != 0)
+            break;
+    }
+
+    /* The keys were saved in order, so they need no sorting. */
+    if (r == 0)
+        r = index_build(tmp);
+
+    if (r != 0) {
+        db_free(tmp);
+        return r;
     }
 
     *db = tmp;
-    closedir(dir);
     return 0;
 }
 
@@ -193,53 +655,343 @@ db_free(db_t *db)
     if (!db)
         return;
 
-    LIST_FOREACH(&db->keys, db_key_t, k, list) {
-        list_pop(&k->list);
-        db_key_free(k);
-    }
+    for (size_t i = 0; i < db->nkeys; i++)
+        file_free(db->keys[i].file);
+
+    if (db->fd >= 0)
+        close(db->fd);
 
-    close(db->fd);
+    free(db->chgs);
+    free(db->keys);
+    free(db->slots);
     free(db);
 }
 
+/* Records a change to name. Changes to the same file are merged later, by
+ * db_apply(), so that a burst of events costs no more than reading them. */
+static int
+pend(db_t *db, const char *name, bool load)
+{
+    db_chg_t *chgs = NULL;
+
+    if (strlen(name) >= sizeof(chgs->name))
+        return 0;
+
+    if (db->nchgs == db->maxchgs) {
+        size_t max = db->maxchgs > 0 ? db->maxchgs * 2 : 16;
+
+        chgs = realloc(db->chgs, max * sizeof(*chgs));
+        if (!chgs)
+            return ENOMEM;
+
+        db->chgs = chgs;
+        db->maxchgs = max;
+    }
+
+    strcpy(db->chgs[db->nchgs].name, name);
+    db->chgs[db->nchgs++].load = load;
+    return 0;
+}
+
 int
 db_event(db_t *db)
 {
-    unsigned char buf[(sizeof(struct inotify_event) + NAME_MAX + 1) * 20] = {};
+    unsigned char buf[(sizeof(struct inotify_event) + NAME_MAX + 1)
+                      * DB_EVENTS] = {};
     const struct inotify_event *ev;
     ssize_t bytes = 0;
     int r;
 
-    bytes = read(db->fd, buf, sizeof(buf));
-    if (bytes < 0)
-        return errno == EAGAIN ? 0 : errno;
+    for (;;) {
+        bytes = read(db->fd, buf, sizeof(buf));
+        if (bytes < 0)
+            return errno == EAGAIN ? 0 : errno;
 
-    for (ssize_t i = 0; i < bytes; i += sizeof(*ev) + ev->len) {
-        ev = (struct inotify_event *) &buf[i];
+        for (ssize_t i = 0; i < bytes; i += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) &buf[i];
 
-        if (ev->len == 0 || ev->name[0] == '.')
-            continue;
-
-        LIST_FOREACH(&db->keys, db_key_t, k, list) {
-            if (strcmp(ev->name, k->name) == 0) {
-                if (ev->mask == IN_ATTRIB) {
-                    r = load_attrs(db, k);
-                    if (r != 0)
-                        return r;
-                } else {
-                    list_pop(&k->list);
-                    db_key_free(k);
-                }
+            /* Events were dropped; which ones can't be known. */
+            if (ev->mask & IN_Q_OVERFLOW) {
+                db->rescan = true;
+                db->nevents++;
+                continue;
             }
-        }
 
-        if (ev->mask & (IN_MOVED_TO | IN_CLOSE_WRITE)) {
-            r = load(db, ev->name);
+            if (ev->len == 0 || ev->name[0] == '.')
+                continue;
+
+            /* Attributes only matter for files already read: tang-gen sets
+             * them before it writes the key. */
+            if (ev->mask == IN_ATTRIB && !find_name(db, ev->name))
+                continue;
+
+            r = pend(db, ev->name, ev->mask != IN_ATTRIB);
             if (r != 0)
                 return r;
+
+            db->nevents++;
         }
     }
+}
 
-    return 0;
+static bool
+same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Compares the directory with the keys and records a change for each file
+ * that differs: new and vanished files, files that aren't the ones read,
+ * and files whose attributes alone have changed. */
+static int
+rescan(db_t *db)
+{
+    bool *seen = NULL;
+    DIR *dir = NULL;
+    int r = 0;
+
+    seen = calloc(db->nkeys + 1, sizeof(*seen));
+    if (!seen)
+        return ENOMEM;
+
+    dir = opendir(db->path);
+    if (!dir) {
+        free(seen);
+        return errno;
+    }
+
+    for (struct dirent *de = readdir(dir); de && r == 0; de = readdir(dir)) {
+        const db_key_t *key = NULL;
+        const db_file_t *file = NULL;
+        struct stat st;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        /* A file that is already gone is handled with the vanished ones. */
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0)
+            continue;
+
+        key = find_name(db, de->d_name);
+        if (!key) {
+            r = pend(db, de->d_name, true);
+            continue;
+        }
+
+        seen[key - db->keys] = true;
+        file = key->file;
+        if (file->ino != st.st_ino || file->size != st.st_size ||
+            !same_time(&file->mtime, &st.st_mtim))
+            r = pend(db, de->d_name, true);
+        else if (!same_time(&file->ctime, &st.st_ctim))
+            r = pend(db, de->d_name, false);
+    }
+
+    for (size_t i = 0; i < db->nkeys && r == 0; i++) {
+        if (!seen[i])
+            r = pend(db, db->keys[i].file->name, true);
+    }
+
+    closedir(dir);
+    free(seen);
+    return r;
+}
+
+static int
+cmp_chg(const void *a, const void *b)
+{
+    const db_chg_t *x = a;
+    const db_chg_t *y = b;
+
+    return strcmp(x->name, y->name);
+}
+
+/* Since both the keys and the changes are sorted by name, the new keys are
+ * made in a single pass over the two. */
+int
+db_apply(db_t *db)
+{
+    db_key_t *keys = NULL;
+    idx_t *idx = NULL;
+    size_t nkeys = 0;
+    size_t k = 0;
+    int ret = 0;
+    int r;
+
+    if (db->rescan) {
+        db->rescan = false;
+        ret = rescan(db);
+    }
+
+    /* Bring changes to the same file together, then merge them. */
+    if (db->nchgs > 0)
+        qsort(db->chgs, db->nchgs, sizeof(*db->chgs), cmp_chg);
+
+    keys = calloc(db->nkeys + db->nchgs + 1, sizeof(*keys));
+    if (!keys)
+        return ENOMEM;
+
+    idx_open(db->path, &idx);
+
+    for (size_t c = 0; c < db->nchgs; c++) {
+        db_chg_t *chg = &db->chgs[c];
+        db_key_t *key = NULL;
+
+        if (c + 1 < db->nchgs && strcmp(chg[1].name, chg->name) == 0) {
+            chg[1].load |= chg->load;
+            continue;
+        }
+
+        while (k < db->nkeys && cmp_name(chg->name, &db->keys[k]) > 0)
+            keys[nkeys++] = db->keys[k++];
+
+        if (k < db->nkeys && cmp_name(chg->name, &db->keys[k]) == 0)
+            key = &db->keys[k++];
+
+        if (!key && !chg->load) {
+            r = 0;
+        } else if (key && !chg->load) {
+            keys[nkeys] = *key;
+            r = load_attrs(&keys[nkeys++]);
+        } else {
+            if (key)
+                file_free(key->file);
+
+            /* A file that is gone now was removed or renamed away. */
+            r = load(db, idx, chg->name, &keys[nkeys]);
+            if (r == 0)
+                nkeys++;
+            else if (r == ENOENT)
+                r = 0;
+        }
+
+        if (ret == 0)
+            ret = r;
+    }
+
+    while (k < db->nkeys)
+        keys[nkeys++] = db->keys[k++];
+
+    free(db->keys);
+    db->keys = keys;
+    db->nkeys = nkeys;
+    db->nchgs = 0;
+    idx_free(idx);
+
+    r = index_build(db);
+    return r != 0 ? r : ret;
+}
+
+const db_key_t *
+db_find(const db_t *db, TANG_KEY_USE use, int nid,
+        const unsigned char *pub, size_t publen)
+{
+    size_t mask = db->nslots - 1;
+    uint32_t h;
+
+    if (db->nslots == 0)
+        return NULL;
+
+    h = hash(nid, pub, publen);
+    for (size_t s = h & mask; db->slots[s] != 0; s = (s + 1) & mask) {
+        const db_key_t *k = &db->keys[db->slots[s] - 1];
+
+        if (k->hash == h && k->use == use && k->nid == nid &&
+            k->publen == publen && memcmp(k->pub, pub, publen) == 0)
+            return k;
+    }
+
+    return NULL;
+}
+
+/* Reads the private key from the key's file onto the shared group for its
+ * curve, and checks that it belongs to the public point the file had when
+ * it was listed. */
+static EC_KEY *
+materialize(const db_key_t *key)
+{
+    unsigned char buf[DB_POINT];
+    const EC_GROUP *grp = NULL;
+    const BIGNUM *prv = NULL;
+    EC_POINT *pub = NULL;
+    EC_KEY *pem = NULL;
+    EC_KEY *ec = NULL;
+
+    pem = read_pem(key->file->path);
+    if (!pem)
+        return NULL;
+
+    grp = grp_get(key->nid);
+    if (!grp)
+        grp = EC_KEY_get0_group(pem);
+
+    prv = EC_KEY_get0_private_key(pem);
+    ec = EC_KEY_new();
+    pub = EC_POINT_new(grp);
+    if (!prv || !ec || !pub ||
+        EC_GROUP_get_curve_name(EC_KEY_get0_group(pem)) != key->nid ||
+        EC_POINT_mul(grp, pub, prv, NULL, NULL, NULL) <= 0 ||
+        encode(grp, pub, buf) != key->publen ||
+        memcmp(buf, key->pub, key->publen) != 0 ||
+        EC_KEY_set_group(ec, grp) <= 0 ||
+        EC_KEY_set_private_key(ec, prv) <= 0 ||
+        EC_KEY_set_public_key(ec, pub) <= 0) {
+        EC_KEY_free(ec);
+        ec = NULL;
+    }
+
+    EC_POINT_free(pub);
+    EC_KEY_free(pem);
+    return ec;
 }
 
+EC_KEY *
+db_key_get(const db_key_t *key)
+{
+    db_file_t *file = key->file;
+    time_t now = time(NULL);
+    EC_KEY *old = NULL;
+    EC_KEY *ec = NULL;
+
+    /* Store only on change, so busy keys don't bounce between CPUs. */
+    if (__atomic_load_n(&file->used, __ATOMIC_RELAXED) != now)
+        __atomic_store_n(&file->used, now, __ATOMIC_RELAXED);
+
+    ec = __atomic_load_n(&file->key, __ATOMIC_ACQUIRE);
+    if (ec)
+        return ec;
+
+    /* The file may have been replaced since it was listed. */
+    ec = materialize(key);
+    if (!ec)
+        return NULL;
+
+    /* If another thread got here first, use its copy. */
+    if (!__atomic_compare_exchange_n(&file->key, &old, ec, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        EC_KEY_free(ec);
+        return old;
+    }
+
+    return ec;
+}
+
+size_t
+db_evict(const db_t *db, time_t idle, EC_KEY **dead, size_t max)
+{
+    time_t now = time(NULL);
+    size_t n = 0;
+
+    for (size_t i = 0; i < db->nkeys && n < max; i++) {
+        db_file_t *file = db->keys[i].file;
+
+        if (now - __atomic_load_n(&file->used, __ATOMIC_RELAXED) < idle)
+            continue;
+
+        dead[n] = __atomic_exchange_n(&file->key, NULL, __ATOMIC_ACQ_REL);
+        if (dead[n])
+            n++;
+    }
+
+    return n;
+}
@@ -18,32 +18,120 @@
 
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
+#include <time.h>
+
+#include <sys/types.h>
 
 #include "../asn1.h"
-#include "list.h"
 
 #include <openssl/ec.h>
 
+/* A pending change to one file: either its contents (including removal) or
+ * only its attributes. */
 typedef struct {
-    char path[PATH_MAX];
-    list_t keys;
-    int fd;
-} db_t;
+    char name[NAME_MAX];
+    bool load;
+} db_chg_t;
 
+/* A key file: what a key was read from, and its private key, which is read
+ * on first use. Shared by every copy of the key made by db_copy(). */
 typedef struct {
-    char name[NAME_MAX];
-    list_t list;
-    EC_KEY *key;
+    EC_KEY *key;        /* NULL until first use, or after eviction. */
+    time_t used;
+    size_t refs;
+    unsigned char *pub; /* The uncompressed public point, as advertised. */
+    const char *name;   /* Points into path. */
+    char *path;
+
+    /* The file as it was read, to tell what a rescan must reload. */
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} db_file_t;
+
+/* A key, as requests see it. Keys are stored side by side, so this holds
+ * only what lookups need; everything else is in the file. */
+typedef struct {
+    db_file_t *file;
+    const unsigned char *pub;   /* file->pub */
+    uint32_t hash;
+    int nid;
     TANG_KEY_USE use;
+    uint8_t publen;
     bool adv;
 } db_key_t;
 
+typedef struct {
+    char path[PATH_MAX];
+    int fd;
+
+    /* Changes read by db_event() but not yet applied by db_apply(). */
+    db_chg_t *chgs;
+    size_t nchgs;
+    size_t maxchgs;
+    size_t nevents;     /* Relevant events read, ever. */
+    bool rescan;        /* Events were lost; db_apply() must look for them. */
+
+    /* The keys, sorted by file name, and an open addressing index of them
+     * by curve and public point. Slots hold a position in keys plus one,
+     * or zero if empty. */
+    db_key_t *keys;
+    size_t nkeys;
+    uint32_t *slots;
+    size_t nslots;
+} db_t;
+
 int
 db_open(const char *dbdir, db_t **db);
 
+/* Makes a copy of the keys, sharing their files, that does not watch the
+ * directory. Copies are never changed, so they may be read by any number of
+ * threads while the original is updated. */
+int
+db_copy(const db_t *db, db_t **copy);
+
 void
 db_free(db_t *db);
 
+/* Writes the keys, without their private keys, to buf if they fit in max
+ * bytes. Returns the number of bytes they take either way. */
+size_t
+db_save(const db_t *db, unsigned char *buf, size_t max);
+
+/* Makes keys from what db_save() wrote, as if read from dbdir. Private keys
+ * are read from there on first use. Like a copy, the result does not watch
+ * the directory. */
+int
+db_load(const char *dbdir, const unsigned char *buf, size_t len, db_t **db);
+
+/* Reads all pending events. Nothing is loaded until db_apply(). If the
+ * kernel's event queue overflowed, sets rescan. */
 int
 db_event(db_t *db);
+
+/* Applies and clears the pending changes, merging them into one per file.
+ * After an overflow, the directory is first compared with the keys, and
+ * only the files that differ are read again. */
+int
+db_apply(db_t *db);
+
+/* Finds the key with the given use, curve and uncompressed public point. */
+const db_key_t *
+db_find(const db_t *db, TANG_KEY_USE use, int nid,
+        const unsigned char *pub, size_t publen);
+
+/* Returns the private key, reading it from its file if it isn't loaded. It
+ * uses the shared group for its curve (see grp_get()) and is checked against
+ * the public point the file had when it was listed. Returns NULL if it
+ * can't be read or no longer matches. */
+EC_KEY *
+db_key_get(const db_key_t *key);
+
+/* Unloads private keys unused for at least idle seconds, storing at most max
+ * of them in dead. A thread may still be using a key returned here, so the
+ * caller frees them only once no thread can be. Returns the number stored. */
+size_t
+db_evict(const db_t *db, time_t idle, EC_KEY **dead, size_t max);
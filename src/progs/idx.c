@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "idx.h"
+
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IDX_FILE ".tang-index"
+#define IDX_MAGIC "TANGIDX2"
+#define IDX_POINT 133   /* An uncompressed secp521r1 point. */
+
+typedef struct {
+    char magic[8];
+    uint32_t nrecs;
+    uint32_t recsize;
+    unsigned char digest[SHA256_DIGEST_LENGTH]; /* Of the records. */
+} hdr_t;
+
+/* One key. Records are fixed-size and sorted by name. */
+typedef struct {
+    char name[NAME_MAX + 1];
+    uint64_t ino;
+    int64_t size;
+    int64_t ctime;      /* In nanoseconds. */
+    int32_t nid;
+    int32_t use;
+    uint8_t adv;
+    uint8_t plen;
+    uint8_t point[IDX_POINT];
+} rec_t;
+
+struct idx {
+    void *map;
+    size_t size;
+    const rec_t *recs;
+    size_t nrecs;
+};
+
+static int
+join(const char *dir, const char *name, char path[PATH_MAX])
+{
+    int r;
+
+    r = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    if (r < 0 || r >= PATH_MAX)
+        return E2BIG;
+
+    return 0;
+}
+
+static bool
+indexed(const rec_t *rec, const struct stat *st)
+{
+    return rec->ino == (uint64_t) st->st_ino
+        && rec->size == (int64_t) st->st_size
+        && rec->ctime == st->st_ctim.tv_sec * 1000000000LL
+                       + st->st_ctim.tv_nsec;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+    return strcmp(((const rec_t *) a)->name, ((const rec_t *) b)->name);
+}
+
+static int
+find(const void *name, const void *rec)
+{
+    return strcmp(name, ((const rec_t *) rec)->name);
+}
+
+int
+idx_open(const char *dbdir, idx_t **idx)
+{
+    unsigned char sum[SHA256_DIGEST_LENGTH];
+    char path[PATH_MAX];
+    idx_t *tmp = NULL;
+    struct stat st;
+    hdr_t hdr;
+    int fd = -1;
+    int r;
+
+    r = join(dbdir, IDX_FILE, path);
+    if (r != 0)
+        return r;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp) {
+        close(fd);
+        return ENOMEM;
+    }
+
+    r = EINVAL;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(hdr))
+        goto error;
+
+    tmp->size = st.st_size;
+    tmp->map = mmap(NULL, tmp->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (tmp->map == MAP_FAILED) {
+        tmp->map = NULL;
+        goto error;
+    }
+
+    memcpy(&hdr, tmp->map, sizeof(hdr));
+    if (memcmp(hdr.magic, IDX_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.recsize != sizeof(rec_t) ||
+        tmp->size != sizeof(hdr) + (size_t) hdr.nrecs * sizeof(rec_t))
+        goto error;
+
+    tmp->recs = (const rec_t *) &((const hdr_t *) tmp->map)[1];
+    tmp->nrecs = hdr.nrecs;
+
+    SHA256((const unsigned char *) tmp->recs, tmp->nrecs * sizeof(rec_t), sum);
+    if (memcmp(sum, hdr.digest, sizeof(sum)) != 0)
+        goto error;
+
+    close(fd);
+    *idx = tmp;
+    return 0;
+
+error:
+    close(fd);
+    idx_free(tmp);
+    return r;
+}
+
+void
+idx_free(idx_t *idx)
+{
+    if (!idx)
+        return;
+
+    if (idx->map)
+        munmap(idx->map, idx->size);
+
+    free(idx);
+}
+
+bool
+idx_load(const idx_t *idx, const char *name, const struct stat *st,
+         int *nid, const unsigned char **pub, size_t *publen,
+         TANG_KEY_USE *use, bool *adv)
+{
+    const rec_t *rec = NULL;
+
+    rec = bsearch(name, idx->recs, idx->nrecs, sizeof(*rec), find);
+    if (!rec || !indexed(rec, st) || rec->plen > IDX_POINT)
+        return false;
+
+    *nid = rec->nid;
+    *pub = rec->point;
+    *publen = rec->plen;
+    *use = rec->use;
+    *adv = rec->adv;
+    return true;
+}
+
+/* Reads a key file into a record. Identity and contents come from the same
+ * open file, so a file that changes meanwhile just won't match later. */
+static int
+make(const char *path, const char *name, rec_t *rec)
+{
+    const EC_POINT *pub = NULL;
+    EC_GROUP *grp = NULL;
+    EC_KEY *key = NULL;
+    FILE *file = NULL;
+    char attr[NAME_MAX];
+    struct stat st;
+    ssize_t len;
+    int r = EINVAL;
+
+    *rec = (rec_t) {};
+    if (strlen(name) >= sizeof(rec->name))
+        return E2BIG;
+    strcpy(rec->name, name);
+
+    file = fopen(path, "r");
+    if (!file)
+        return errno;
+
+    if (fstat(fileno(file), &st) != 0) {
+        r = errno;
+        goto egress;
+    }
+
+    rec->ino = st.st_ino;
+    rec->size = st.st_size;
+    rec->ctime = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+
+    grp = PEM_read_ECPKParameters(file, NULL, NULL, NULL);
+    if (!grp)
+        goto egress;
+
+    key = PEM_read_ECPrivateKey(file, NULL, NULL, NULL);
+    if (!key || EC_KEY_set_group(key, grp) <= 0)
+        goto egress;
+
+    rec->nid = EC_GROUP_get_curve_name(grp);
+    pub = EC_KEY_get0_public_key(key);
+    if (rec->nid == NID_undef || !pub)
+        goto egress;
+
+    rec->plen = EC_POINT_point2oct(grp, pub, POINT_CONVERSION_UNCOMPRESSED,
+                                   rec->point, sizeof(rec->point), NULL);
+    if (rec->plen == 0)
+        goto egress;
+
+    /* Interpreted just as the database does. */
+    rec->use = TANG_KEY_USE_NONE;
+    len = fgetxattr(fileno(file), "user.tang.use", attr, sizeof(attr));
+    if (len >= 0) {
+        if (strncmp(attr, "rec", len < 3 ? len : 3) == 0)
+            rec->use = TANG_KEY_USE_REC;
+        else if (strncmp(attr, "sig", len < 3 ? len : 3) == 0)
+            rec->use = TANG_KEY_USE_SIG;
+    }
+
+    len = fgetxattr(fileno(file), "user.tang.adv", attr, sizeof(attr));
+    rec->adv = len >= 0;
+    r = 0;
+
+egress:
+    EC_GROUP_free(grp);
+    EC_KEY_free(key);
+    fclose(file);
+    return r;
+}
+
+static int
+save(const char *dir, rec_t *recs, size_t nrecs)
+{
+    hdr_t hdr = { .nrecs = nrecs, .recsize = sizeof(rec_t) };
+    size_t size = nrecs * sizeof(*recs);
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    int fd = -1;
+    int r;
+
+    r = join(dir, IDX_FILE, path);
+    if (r == 0)
+        r = join(dir, IDX_FILE ".XXXXXX", tmp);
+    if (r != 0)
+        return r;
+
+    qsort(recs, nrecs, sizeof(*recs), cmp);
+    memcpy(hdr.magic, IDX_MAGIC, sizeof(hdr.magic));
+    SHA256((unsigned char *) recs, size, hdr.digest);
+
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return errno;
+
+    errno = 0;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write(fd, recs, size) != (ssize_t) size ||
+        fsync(fd) != 0 || rename(tmp, path) != 0) {
+        r = errno != 0 ? errno : EIO;
+        unlink(tmp);
+    }
+
+    close(fd);
+    return r;
+}
+
+int
+idx_update(const char *path)
+{
+    char dir[PATH_MAX] = ".";
+    const char *name = path;
+    const char *slash = NULL;
+    rec_t *recs = NULL;
+    idx_t *idx = NULL;
+    size_t nrecs = 0;
+    int dfd = -1;
+    int r;
+
+    slash = strrchr(path, '/');
+    if (slash) {
+        if ((size_t) (slash - path) >= sizeof(dir))
+            return E2BIG;
+
+        if (slash == path) {
+            strcpy(dir, "/");
+        } else {
+            memcpy(dir, path, slash - path);
+            dir[slash - path] = 0;
+        }
+
+        name = slash + 1;
+    }
+
+    /* Serialize updates on the directory itself. */
+    dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
+        return errno;
+
+    if (flock(dfd, LOCK_EX) != 0) {
+        r = errno;
+        goto egress;
+    }
+
+    r = idx_open(dir, &idx);
+    if (r != 0 && r != ENOENT && r != EINVAL)
+        goto egress;
+
+    recs = calloc((idx ? idx->nrecs : 0) + 1, sizeof(*recs));
+    if (!recs) {
+        r = ENOMEM;
+        goto egress;
+    }
+
+    /* Keep the records that still describe their files. */
+    for (size_t i = 0; idx && i < idx->nrecs; i++) {
+        struct stat st;
+
+        if (strcmp(idx->recs[i].name, name) == 0)
+            continue;
+
+        if (fstatat(dfd, idx->recs[i].name, &st, 0) == 0 &&
+            indexed(&idx->recs[i], &st))
+            recs[nrecs++] = idx->recs[i];
+    }
+
+    r = make(path, name, &recs[nrecs]);
+    if (r == 0)
+        nrecs++;
+    else if (r != ENOENT)
+        goto egress;
+
+    r = save(dir, recs, nrecs);
+
+egress:
+    free(recs);
+    idx_free(idx);
+    close(dfd);
+    return r;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../asn1.h"
+
+#include <sys/stat.h>
+#include <stdbool.h>
+
+/* The keystore index: one file in the key directory describing every key,
+ * so that the server can learn its keys without parsing PEM or reading
+ * extended attributes. Only public data is kept; private keys are always
+ * read from the PEM files, which remain the source of truth. A record is
+ * only used while its file is the very one indexed (same inode, size and
+ * change time, which setting attributes also updates). */
+typedef struct idx idx_t;
+
+/* Maps the index for dbdir. Returns ENOENT if there is none and EINVAL if
+ * it is damaged. */
+int
+idx_open(const char *dbdir, idx_t **idx);
+
+void
+idx_free(idx_t *idx);
+
+/* Looks up name and, if st still describes the file that was indexed, sets
+ * its curve, uncompressed public point (which points into the index) and
+ * attributes. */
+bool
+idx_load(const idx_t *idx, const char *name, const struct stat *st,
+         int *nid, const unsigned char **pub, size_t *publen,
+         TANG_KEY_USE *use, bool *adv);
+
+/* Reindexes the key file at path (or drops it, if it is gone) along with
+ * any other files that have disappeared. The index is replaced atomically
+ * and concurrent updates are serialized. */
+int
+idx_update(const char *path);
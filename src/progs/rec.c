@@ -17,6 +17,7 @@
  */
 
 #include "../conv.h"
+#include "../grp.h"
 #include "rec.h"
 
 #include <openssl/objects.h>
@@ -24,99 +25,198 @@
 #include <errno.h>
 #include <string.h>
 
-TANG_MSG_ERR
-rec_decrypt(const db_t *db, const TANG_MSG_REC_REQ *req, pkt_t *pkt,
-            BN_CTX *ctx)
+/* Wraps bytes from a request as an OCTET STRING, without copying them. */
+#define OS(d, l) \
+    (&(ASN1_OCTET_STRING) { \
+        .type = V_ASN1_OCTET_STRING, \
+        .data = (unsigned char *) (d), \
+        .length = (l) \
+    })
+
+/* Re-encodes a point given in another form (e.g. compressed) uncompressed. */
+static int
+normalize(int nid, const unsigned char *in, size_t len,
+          ASN1_OCTET_STRING **out, BN_CTX *ctx)
 {
-    TANG_MSG_ERR err = TANG_MSG_ERR_INTERNAL;
-    ASN1_OCTET_STRING *os = NULL;
-    const db_key_t *key = NULL;
     const EC_GROUP *grp = NULL;
-    const BIGNUM *prv = NULL;
-    EC_POINT *x = NULL;
-    int r;
+    EC_POINT *p = NULL;
+    int r = ENOMEM;
 
-    LIST_FOREACH(&db->keys, db_key_t, k, list) {
-        const EC_POINT *pub;
-        int nid;
+    grp = grp_get(nid);
+    if (!grp)
+        return ENOENT;
 
-        if (k->use != TANG_KEY_USE_REC)
-            continue;
+    p = EC_POINT_new(grp);
+    *out = ASN1_OCTET_STRING_new();
+    if (!p || !*out)
+        goto egress;
 
-        grp = EC_KEY_get0_group(k->key);
-        if (!grp)
-            continue;
+    r = conv_os2point(grp, OS(in, len), p, ctx);
+    if (r == 0)
+        r = conv_point2os(grp, p, *out, ctx);
 
-        nid = EC_GROUP_get_curve_name(grp);
-        if (nid == NID_undef)
-            continue;
+egress:
+    EC_POINT_free(p);
+    return r;
+}
 
-        if (OBJ_obj2nid(req->key->grp) != nid)
-            continue;
+/* Tells whether any recovery key is on a curve. */
+static bool
+has_curve(const db_t *db, int nid)
+{
+    for (size_t i = 0; i < db->nkeys; i++) {
+        if (db->keys[i].use == TANG_KEY_USE_REC && db->keys[i].nid == nid)
+            return true;
+    }
 
-        pub = EC_KEY_get0_public_key(k->key);
-        if (!pub)
-            continue;
+    return false;
+}
 
-        if (!x) {
-            x = EC_POINT_new(grp);
-            if (!x)
-                goto error;
-
-            switch (conv_os2point(grp, req->key->key, x, ctx)) {
-            case 0:
-                break;
-            case EINVAL:
-                err = TANG_MSG_ERR_INVALID_REQUEST;
-                goto error;
-            default:
-                goto error;
-            }
-        }
+/* Finds the key for a request and multiplies its point by the key, leaving
+ * the result in projective coordinates. */
+static TANG_MSG_ERR
+multiply(const db_t *db, const pkt_rec_t *req, const EC_GROUP **grp,
+         EC_POINT **y, BN_CTX *ctx)
+{
+    TANG_MSG_ERR err = TANG_MSG_ERR_INTERNAL;
+    const unsigned char *pub = req->key;
+    ASN1_OCTET_STRING *os = NULL;
+    const db_key_t *key = NULL;
+    const BIGNUM *prv = NULL;
+    size_t publen = req->keylen;
+    EC_POINT *x = NULL;
+    EC_KEY *ec = NULL;
+    int r;
 
-        if (EC_POINT_cmp(grp, pub, x, ctx) == 0) {
-            key = k;
-            break;
-        }
+    if (req->grp == NID_undef)
+        return TANG_MSG_ERR_NOTFOUND_KEY;
+
+    /* Keys are indexed by their uncompressed encoding, as advertised. */
+    if (publen > 0 && pub[0] != POINT_CONVERSION_UNCOMPRESSED) {
+        r = normalize(req->grp, pub, publen, &os, ctx);
+        if (r == EINVAL && has_curve(db, req->grp))
+            err = TANG_MSG_ERR_INVALID_REQUEST;
+        else if (r == EINVAL || r == ENOENT)
+            err = TANG_MSG_ERR_NOTFOUND_KEY;
+        if (r != 0)
+            goto error;
+        pub = os->data;
+        publen = os->length;
     }
 
+    /* A key that is not even a point, on a curve we have keys for, is an
+     * invalid request rather than an unknown key. */
+    key = db_find(db, TANG_KEY_USE_REC, req->grp, pub, publen);
     if (!key) {
         err = TANG_MSG_ERR_NOTFOUND_KEY;
+        if (!os && has_curve(db, req->grp) &&
+            normalize(req->grp, pub, publen, &os, ctx) == EINVAL)
+            err = TANG_MSG_ERR_INVALID_REQUEST;
         goto error;
     }
 
-    prv = EC_KEY_get0_private_key(key->key);
-    grp = EC_KEY_get0_group(key->key);
-    os = ASN1_OCTET_STRING_new();
-    if (!prv || !grp || !os)
+    /* The private key is read from its file on first use. */
+    ec = db_key_get(key);
+    if (!ec)
+        goto error;
+
+    /* Multiply on the shared, specialized group for the curve. */
+    prv = EC_KEY_get0_private_key(ec);
+    *grp = grp_get(key->nid);
+    if (!*grp)
+        *grp = EC_KEY_get0_group(ec);
+    if (!prv || !*grp)
+        goto error;
+
+    x = EC_POINT_new(*grp);
+    if (!x)
         goto error;
 
-    r = conv_os2point(grp, req->x, x, ctx);
+    r = conv_os2point(*grp, OS(req->x, req->xlen), x, ctx);
     if (r != 0) {
         err = TANG_MSG_ERR_INVALID_REQUEST;
         goto error;
     }
 
-    if (EC_POINT_mul(grp, x, NULL, x, prv, ctx) <= 0)
+    if (EC_POINT_mul(*grp, x, NULL, x, prv, ctx) <= 0)
         goto error;
 
-    r = conv_point2os(grp, x, os, ctx);
-    if (r != 0)
-        goto error;
+    ASN1_OCTET_STRING_free(os);
+    *y = x;
+    return TANG_MSG_ERR_NONE;
+
+error:
+    ASN1_OCTET_STRING_free(os);
+    EC_POINT_free(x);
+    return err;
+}
+
+/* Writes the reply for a result straight into its packet. */
+static TANG_MSG_ERR
+reply(const EC_GROUP *grp, const EC_POINT *y, pkt_t *pkt, BN_CTX *ctx)
+{
+    const point_conversion_form_t form = POINT_CONVERSION_UNCOMPRESSED;
+    unsigned char *buf;
+    size_t len;
+
+    len = EC_POINT_point2oct(grp, y, form, NULL, 0, ctx);
+    if (len == 0)
+        return TANG_MSG_ERR_INTERNAL;
+
+    buf = pkt_rec_rep(pkt, len);
+    if (!buf)
+        return TANG_MSG_ERR_INTERNAL;
+
+    if (EC_POINT_point2oct(grp, y, form, buf, len, ctx) != len) {
+        pkt->size = 0;
+        return TANG_MSG_ERR_INTERNAL;
+    }
+
+    return TANG_MSG_ERR_NONE;
+}
 
-    r = pkt_encode((ASN1_VALUE *) &(TANG_MSG) {
-        .type = TANG_MSG_TYPE_REC_REP,
-        .val.rec.rep = &(TANG_MSG_REC_REP) {
-            .y = os
+void
+rec_decrypt(const db_t *db, const pkt_rec_t *reqs, pkt_t **pkts,
+            TANG_MSG_ERR *errs, size_t n, BN_CTX *ctx)
+{
+    if (n == 0)
+        return;
+
+    const EC_GROUP *grps[n];
+    EC_POINT *pts[n];
+    EC_POINT *ys[n];
+    bool done[n];
+
+    for (size_t i = 0; i < n; i++) {
+        ys[i] = NULL;
+        errs[i] = multiply(db, &reqs[i], &grps[i], &ys[i], ctx);
+        done[i] = !ys[i];
+    }
+
+    /* Normalize each curve's results together. If this fails, each point is
+     * just normalized on its own when encoded below. */
+    for (size_t i = 0; i < n; i++) {
+        size_t m = 0;
+
+        if (done[i])
+            continue;
+
+        for (size_t j = i; j < n; j++) {
+            if (!done[j] && grps[j] == grps[i]) {
+                pts[m++] = ys[j];
+                done[j] = true;
+            }
         }
-    }, &TANG_MSG_it, pkt);
 
-    ASN1_BIT_STRING_free(os);
-    EC_POINT_free(x);
-    return r == 0 ? TANG_MSG_ERR_NONE : TANG_MSG_ERR_INTERNAL;
+        if (m > 1)
+            EC_POINTs_make_affine(grps[i], m, pts, ctx);
+    }
 
-error:
-    ASN1_BIT_STRING_free(os);
-    EC_POINT_free(x);
-    return err == TANG_MSG_ERR_NONE ? TANG_MSG_ERR_INTERNAL : err;
+    for (size_t i = 0; i < n; i++) {
+        if (!ys[i])
+            continue;
+
+        errs[i] = reply(grps[i], ys[i], pkts[i], ctx);
+        EC_POINT_free(ys[i]);
+    }
 }
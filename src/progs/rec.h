@@ -21,6 +21,9 @@
 #include "../pkt.h"
 #include "db.h"
 
-TANG_MSG_ERR
-rec_decrypt(const db_t *db, const TANG_MSG_REC_REQ *req, pkt_t *pkt,
-            BN_CTX *ctx);
+/* Answers n recovery requests, setting errs[i] for each. Results on the same
+ * curve are converted to affine coordinates together, sharing a single field
+ * inversion. */
+void
+rec_decrypt(const db_t *db, const pkt_rec_t *reqs, pkt_t **pkts,
+            TANG_MSG_ERR *errs, size_t n, BN_CTX *ctx);
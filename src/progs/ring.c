@@ -0,0 +1,622 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ring.h"
+
+#include <linux/io_uring.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_DEPTH 128
+#define RING_NBUFS 64 /* Must be a power of two. */
+#define RING_BUFSZ 8192
+#define RING_NSOCKS 16
+
+#define OP_RECV 1ULL
+#define OP_SEND 2ULL
+#define TAG(op, idx) ((op) << 32 | (idx))
+
+#define MIN(a, b) \
+    ({ typeof(a) __a = a; typeof(a) __b = b; __a > __b ? __b : __a; })
+#define MAX(a, b) \
+    ({ typeof(a) __a = a; typeof(a) __b = b; __a > __b ? __a : __b; })
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t size;
+    int sock;
+} peer_t;
+
+struct ring {
+    bool stream;
+    int fd;
+    int efd;
+
+    struct {
+        unsigned *head;
+        unsigned *tail;
+        unsigned *mask;
+        unsigned *entries;
+        unsigned *array;
+        struct io_uring_sqe *sqes;
+        unsigned local;
+        unsigned pending;
+    } sq;
+
+    struct {
+        unsigned *head;
+        unsigned *tail;
+        unsigned *mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+
+    unsigned char *sqmap;
+    unsigned char *cqmap;
+    size_t sqlen;
+    size_t cqlen;
+    size_t sqelen;
+
+    /* The provided buffers, and the receives completed into them that have
+     * not yet been handed to srv_main(). */
+    struct io_uring_buf_ring *br;
+    unsigned char *bufs;
+    uint16_t brtail;
+
+    struct {
+        uint32_t len;
+        uint16_t bid;
+        uint16_t idx;
+    } done[RING_NBUFS];
+    size_t dhead;
+    size_t ndone;
+
+    /* Sockets with a multishot receive, and whether it needs re-arming. */
+    int socks[RING_NSOCKS];
+    bool idle[RING_NSOCKS];
+    size_t nsocks;
+
+    /* Where the requests in the last batch came from, and the headers for
+     * sending their replies. */
+    struct msghdr rmsg;
+    peer_t peers[SRV_BATCH];
+    struct msghdr smsgs[SRV_BATCH];
+    int sfds[SRV_BATCH];
+    struct iovec siovs[SRV_BATCH];
+    size_t inflight;
+    size_t want;
+
+    /* Errors and end of stream reported by completions. */
+    bool eof;
+    int err;
+
+    /* Reassembly buffer for stream sockets. */
+    pkt_t buf;
+};
+
+static int
+enter(ring_t *ring, unsigned wait)
+{
+    int r;
+
+    __atomic_store_n(ring->sq.tail, ring->sq.local, __ATOMIC_RELEASE);
+
+    r = syscall(__NR_io_uring_enter, ring->fd, ring->sq.pending, wait,
+                wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r < 0)
+        return errno;
+
+    ring->sq.pending -= r;
+    return 0;
+}
+
+static struct io_uring_sqe *
+sqe(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = NULL;
+    unsigned idx;
+
+    if (ring->sq.local - __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE)
+            >= *ring->sq.entries) {
+        if (enter(ring, 0) != 0)
+            return NULL;
+
+        if (ring->sq.local - __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE)
+                >= *ring->sq.entries)
+            return NULL;
+    }
+
+    idx = ring->sq.local++ & *ring->sq.mask;
+    ring->sq.array[idx] = idx;
+    ring->sq.pending++;
+
+    sqe = &ring->sq.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void
+recycle(ring_t *ring, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &ring->br->bufs[ring->brtail & (RING_NBUFS - 1)];
+    buf->addr = (uintptr_t) &ring->bufs[bid * RING_BUFSZ];
+    buf->len = RING_BUFSZ;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring->br->tail, ++ring->brtail, __ATOMIC_RELEASE);
+}
+
+static int
+arm(ring_t *ring, size_t idx)
+{
+    struct io_uring_sqe *s = NULL;
+
+    s = sqe(ring);
+    if (!s)
+        return EAGAIN;
+
+    s->fd = ring->socks[idx];
+    s->flags = IOSQE_BUFFER_SELECT;
+    s->buf_group = 0;
+    s->ioprio = IORING_RECV_MULTISHOT;
+    s->user_data = TAG(OP_RECV, idx);
+
+    if (ring->stream) {
+        s->opcode = IORING_OP_RECV;
+    } else {
+        s->opcode = IORING_OP_RECVMSG;
+        s->addr = (uintptr_t) &ring->rmsg;
+        s->len = 1;
+    }
+
+    ring->idle[idx] = false;
+    return 0;
+}
+
+static void
+rearm(ring_t *ring)
+{
+    for (size_t i = 0; i < ring->nsocks; i++) {
+        if (ring->idle[i] && arm(ring, i) != 0)
+            break;
+    }
+}
+
+/* Consumes all completions. Receives are queued until asked for. */
+static void
+reap(ring_t *ring)
+{
+    unsigned head = *ring->cq.head;
+    unsigned tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &ring->cq.cqes[head & *ring->cq.mask];
+        uint16_t idx = cqe->user_data & UINT16_MAX;
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->user_data >> 32 == OP_SEND) {
+            if (cqe->res < 0)
+                ring->err = -cqe->res;
+            else if (ring->stream && (size_t) cqe->res != ring->want)
+                ring->err = EIO;
+            ring->inflight--;
+            continue;
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            ring->idle[idx] = true;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            size_t tl = (ring->dhead + ring->ndone++) % RING_NBUFS;
+
+            ring->done[tl].len = cqe->res > 0 ? cqe->res : 0;
+            ring->done[tl].bid = bid;
+            ring->done[tl].idx = idx;
+        } else if (cqe->res == 0) {
+            ring->eof = true;
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            ring->err = -cqe->res;
+        }
+    }
+
+    __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+}
+
+int
+ring_init(bool stream, ring_t **ring)
+{
+    struct io_uring_params p = {};
+    ring_t *tmp = NULL;
+    int r = ENOMEM;
+
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp)
+        return ENOMEM;
+
+    tmp->stream = stream;
+    tmp->fd = -1;
+    tmp->efd = -1;
+    tmp->sqmap = tmp->cqmap = MAP_FAILED;
+    tmp->sq.sqes = MAP_FAILED;
+    tmp->br = MAP_FAILED;
+
+    tmp->fd = syscall(__NR_io_uring_setup, RING_DEPTH, &p);
+    if (tmp->fd < 0) {
+        r = errno;
+        goto error;
+    }
+
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        r = EOPNOTSUPP;
+        goto error;
+    }
+
+    /* Map the submission and completion queues. */
+    tmp->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    tmp->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        tmp->sqlen = tmp->cqlen = MAX(tmp->sqlen, tmp->cqlen);
+
+    tmp->sqmap = mmap(NULL, tmp->sqlen, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, tmp->fd, IORING_OFF_SQ_RING);
+    if (tmp->sqmap == MAP_FAILED)
+        goto error;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        tmp->cqmap = tmp->sqmap;
+    } else {
+        tmp->cqmap = mmap(NULL, tmp->cqlen, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, tmp->fd,
+                          IORING_OFF_CQ_RING);
+        if (tmp->cqmap == MAP_FAILED)
+            goto error;
+    }
+
+    tmp->sqelen = p.sq_entries * sizeof(struct io_uring_sqe);
+    tmp->sq.sqes = mmap(NULL, tmp->sqelen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, tmp->fd, IORING_OFF_SQES);
+    if (tmp->sq.sqes == MAP_FAILED)
+        goto error;
+
+    tmp->sq.head = (void *) (tmp->sqmap + p.sq_off.head);
+    tmp->sq.tail = (void *) (tmp->sqmap + p.sq_off.tail);
+    tmp->sq.mask = (void *) (tmp->sqmap + p.sq_off.ring_mask);
+    tmp->sq.entries = (void *) (tmp->sqmap + p.sq_off.ring_entries);
+    tmp->sq.array = (void *) (tmp->sqmap + p.sq_off.array);
+    tmp->sq.local = *tmp->sq.tail;
+
+    tmp->cq.head = (void *) (tmp->cqmap + p.cq_off.head);
+    tmp->cq.tail = (void *) (tmp->cqmap + p.cq_off.tail);
+    tmp->cq.mask = (void *) (tmp->cqmap + p.cq_off.ring_mask);
+    tmp->cq.cqes = (void *) (tmp->cqmap + p.cq_off.cqes);
+
+    /* Register the provided buffers. */
+    tmp->bufs = malloc(RING_NBUFS * RING_BUFSZ);
+    if (!tmp->bufs)
+        goto error;
+
+    tmp->br = mmap(NULL, RING_NBUFS * sizeof(struct io_uring_buf),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tmp->br == MAP_FAILED)
+        goto error;
+
+    if (syscall(__NR_io_uring_register, tmp->fd, IORING_REGISTER_PBUF_RING,
+                &(struct io_uring_buf_reg) {
+                    .ring_addr = (uintptr_t) tmp->br,
+                    .ring_entries = RING_NBUFS,
+                    .bgid = 0,
+                }, 1) != 0) {
+        r = errno == EINVAL ? EOPNOTSUPP : errno;
+        goto error;
+    }
+
+    for (uint16_t i = 0; i < RING_NBUFS; i++)
+        recycle(tmp, i);
+
+    /* Completions are announced on an eventfd rather than the ring itself,
+     * so that completions already reaped can be announced again. */
+    tmp->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (tmp->efd < 0) {
+        r = errno;
+        goto error;
+    }
+
+    if (syscall(__NR_io_uring_register, tmp->fd, IORING_REGISTER_EVENTFD,
+                &tmp->efd, 1) != 0) {
+        r = errno;
+        goto error;
+    }
+
+    tmp->rmsg.msg_namelen = sizeof(struct sockaddr_storage);
+
+    *ring = tmp;
+    return 0;
+
+error:
+    ring_free(tmp);
+    return r;
+}
+
+void
+ring_free(ring_t *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->br != MAP_FAILED)
+        munmap(ring->br, RING_NBUFS * sizeof(struct io_uring_buf));
+
+    if (ring->sq.sqes != MAP_FAILED)
+        munmap(ring->sq.sqes, ring->sqelen);
+
+    if (ring->cqmap != MAP_FAILED && ring->cqmap != ring->sqmap)
+        munmap(ring->cqmap, ring->cqlen);
+
+    if (ring->sqmap != MAP_FAILED)
+        munmap(ring->sqmap, ring->sqlen);
+
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    if (ring->efd >= 0)
+        close(ring->efd);
+
+    pkt_cleanup(&ring->buf);
+    free(ring->bufs);
+    free(ring);
+}
+
+int
+ring_fd(const ring_t *ring)
+{
+    return ring->efd;
+}
+
+int
+ring_add(ring_t *ring, int sock)
+{
+    int r;
+
+    if (ring->nsocks == RING_NSOCKS || (ring->stream && ring->nsocks > 0))
+        return E2BIG;
+
+    ring->socks[ring->nsocks] = sock;
+    r = arm(ring, ring->nsocks++);
+    if (r != 0)
+        return r;
+
+    /* Kernels without multishot receives reject the request right away. */
+    ring->err = 0;
+    r = enter(ring, 0);
+    if (r != 0)
+        return r;
+
+    reap(ring);
+    if (ring->err == EINVAL)
+        return EOPNOTSUPP;
+
+    return ring->err;
+}
+
+int
+ring_probe(bool stream)
+{
+    ring_t *ring = NULL;
+    int socks[2];
+    int r;
+
+    if (socketpair(AF_UNIX, (stream ? SOCK_STREAM : SOCK_DGRAM) | SOCK_CLOEXEC,
+                   0, socks) != 0)
+        return errno;
+
+    r = ring_init(stream, &ring);
+    if (r == 0)
+        r = ring_add(ring, socks[0]);
+
+    ring_free(ring);
+    close(socks[0]);
+    close(socks[1]);
+    return r;
+}
+
+static int
+req_stream(ring_t *ring, pkt_t *pkts, size_t *npkts)
+{
+    int r;
+
+    /* Append received data to the stream, then split off requests. */
+    for (; ring->ndone > 0; ring->ndone--) {
+        typeof(*ring->done) *d = &ring->done[ring->dhead];
+
+        if (pkt_reserve(&ring->buf, ring->buf.size + d->len) != 0)
+            break;
+
+        memcpy(&ring->buf.data[ring->buf.size],
+               &ring->bufs[d->bid * RING_BUFSZ], d->len);
+        ring->buf.size += d->len;
+
+        recycle(ring, d->bid);
+        ring->dhead = (ring->dhead + 1) % RING_NBUFS;
+    }
+
+    r = pkt_split(&ring->buf, pkts, npkts);
+    if (r == EAGAIN && ring->ndone == 0 && ring->err != 0)
+        return ring->err;
+
+    if (r == EAGAIN && ring->ndone == 0 && ring->eof) {
+        *npkts = 0;
+        return 0;
+    }
+
+    ring->peers[0].sock = ring->socks[0];
+    return r;
+}
+
+static int
+req_dgram(ring_t *ring, pkt_t *pkts, size_t *npkts)
+{
+    const size_t hdr = sizeof(struct io_uring_recvmsg_out)
+                     + ring->rmsg.msg_namelen;
+    size_t n = 0;
+
+    for (; n < *npkts && ring->ndone > 0; ring->ndone--) {
+        typeof(*ring->done) *d = &ring->done[ring->dhead];
+        const struct io_uring_recvmsg_out *out = NULL;
+        const unsigned char *buf = NULL;
+
+        buf = &ring->bufs[d->bid * RING_BUFSZ];
+        out = (const struct io_uring_recvmsg_out *) buf;
+
+        /* Drop truncated datagrams, just like undecodable ones. */
+        if (d->len >= hdr && !(out->flags & MSG_TRUNC)
+            && out->payloadlen <= d->len - hdr
+            && pkt_reserve(&pkts[n], out->payloadlen) == 0) {
+            memcpy(pkts[n].data, &buf[hdr], out->payloadlen);
+            pkts[n].size = out->payloadlen;
+
+            ring->peers[n].sock = ring->socks[d->idx];
+            ring->peers[n].size = MIN(out->namelen, ring->rmsg.msg_namelen);
+            memcpy(&ring->peers[n].addr, &buf[sizeof(*out)],
+                   ring->peers[n].size);
+            n++;
+        }
+
+        recycle(ring, d->bid);
+        ring->dhead = (ring->dhead + 1) % RING_NBUFS;
+    }
+
+    /* Receive errors on datagram sockets are transient. */
+    ring->err = 0;
+
+    *npkts = n;
+    return n > 0 ? 0 : EAGAIN;
+}
+
+int
+ring_req(int sock, pkt_t *pkts, size_t *npkts, void *misc)
+{
+    ring_t *ring = misc;
+    eventfd_t cnt;
+    int r;
+
+    eventfd_read(ring->efd, &cnt);
+    reap(ring);
+
+    if (ring->stream)
+        r = req_stream(ring, pkts, npkts);
+    else
+        r = req_dgram(ring, pkts, npkts);
+
+    /* Buffers have been returned, so ended receives can resume. */
+    rearm(ring);
+    if (ring->sq.pending > 0) {
+        int e = enter(ring, 0);
+        if (e != 0 && r == EAGAIN)
+            return e;
+    }
+
+    return r;
+}
+
+int
+ring_rep(int sock, const pkt_t *pkts, size_t npkts, void *misc)
+{
+    ring_t *ring = misc;
+    size_t n = 0;
+
+    ring->want = 0;
+    ring->err = 0;
+
+    for (size_t i = 0; i < npkts; i++) {
+        if (pkts[i].size <= 0)
+            continue;
+
+        ring->siovs[n] = (struct iovec) {
+            .iov_base = (void *) pkt_data(&pkts[i]),
+            .iov_len = pkts[i].size,
+        };
+        ring->want += pkts[i].size;
+
+        /* A stream's requests all come from its one socket. */
+        ring->sfds[n] = ring->peers[ring->stream ? 0 : i].sock;
+        if (!ring->stream) {
+            ring->smsgs[n] = (struct msghdr) {
+                .msg_name = &ring->peers[i].addr,
+                .msg_namelen = ring->peers[i].size,
+                .msg_iov = &ring->siovs[n],
+                .msg_iovlen = 1,
+            };
+        }
+
+        n++;
+    }
+
+    if (n == 0)
+        return 0;
+
+    /* A stream gets all its replies, in order, from a single send. */
+    if (ring->stream) {
+        ring->smsgs[0] = (struct msghdr) {
+            .msg_iov = ring->siovs,
+            .msg_iovlen = n,
+        };
+        n = 1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        struct io_uring_sqe *s = sqe(ring);
+        if (!s)
+            return EAGAIN;
+
+        s->opcode = IORING_OP_SENDMSG;
+        s->fd = ring->sfds[i];
+        s->addr = (uintptr_t) &ring->smsgs[i];
+        s->len = 1;
+        s->msg_flags = ring->stream ? MSG_WAITALL : 0;
+        s->user_data = TAG(OP_SEND, 0);
+        ring->inflight++;
+    }
+
+    /* The replies live in srv_main()'s buffers, so wait until they're sent.
+     * Sends usually complete inline, in which case this is one syscall. */
+    for (unsigned wait = 0; ring->inflight > 0; wait = ring->inflight) {
+        int r = enter(ring, wait);
+        if (r != 0 && r != EINTR)
+            return r;
+
+        reap(ring);
+    }
+
+    /* Receives that completed meanwhile still need to wake the worker. */
+    if (ring->ndone > 0 || ring->eof)
+        eventfd_write(ring->efd, 1);
+
+    /* Failed datagrams are dropped, just like lost ones. */
+    return ring->stream ? ring->err : 0;
+}
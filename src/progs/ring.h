@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "srv.h"
+
+#include <errno.h>
+#include <stdbool.h>
+
+/* An io_uring transport. Sockets added to the ring have a multishot receive
+ * posted on them at all times, fed from a ring of provided buffers, and each
+ * batch of replies is submitted with a single io_uring_enter().
+ *
+ * The ring's file descriptor becomes readable when receives complete, so it
+ * is watched from an epoll set like any socket: pass ring_req and ring_rep
+ * to srv_main() with the ring as misc. */
+typedef struct ring ring_t;
+
+#ifdef HAVE_IO_URING
+
+/* Checks that the kernel has everything a ring needs: provided buffer rings
+ * and multishot receives. Returns zero if so, or the reason why not. */
+int
+ring_probe(bool stream);
+
+int
+ring_init(bool stream, ring_t **ring);
+
+void
+ring_free(ring_t *ring);
+
+int
+ring_fd(const ring_t *ring);
+
+int
+ring_add(ring_t *ring, int sock);
+
+int
+ring_req(int sock, pkt_t *pkts, size_t *npkts, void *misc);
+
+int
+ring_rep(int sock, const pkt_t *pkts, size_t npkts, void *misc);
+
+#else /* Without io_uring headers, every ring reports ENOSYS. */
+
+static inline int
+ring_probe(bool stream)
+{
+    return ENOSYS;
+}
+
+static inline int
+ring_init(bool stream, ring_t **ring)
+{
+    return ENOSYS;
+}
+
+static inline void
+ring_free(ring_t *ring)
+{
+}
+
+static inline int
+ring_fd(const ring_t *ring)
+{
+    return -1;
+}
+
+static inline int
+ring_add(ring_t *ring, int sock)
+{
+    return ENOSYS;
+}
+
+static inline int
+ring_req(int sock, pkt_t *pkts, size_t *npkts, void *misc)
+{
+    return ENOSYS;
+}
+
+static inline int
+ring_rep(int sock, const pkt_t *pkts, size_t npkts, void *misc)
+{
+    return ENOSYS;
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shm.h"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The start of the region. The generations follow, each in its own half. */
+typedef struct {
+    uint64_t gen;       /* The latest; zero before the first. */
+    uint64_t lens[2];
+    uint64_t active[];  /* The generation each child is reading, or zero. */
+} hdr_t;
+
+struct shm {
+    hdr_t *hdr;
+    unsigned char *halves[2];
+    size_t size;        /* Of each half. */
+    size_t map;         /* Of the whole mapping. */
+    size_t nprocs;
+    size_t slot;        /* This child's; only valid in a child. */
+    int *fds;           /* Each child's notification. */
+};
+
+int
+shm_init(size_t nprocs, size_t size, shm_t **shm)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t hlen = sizeof(hdr_t) + nprocs * sizeof(uint64_t);
+    shm_t *tmp = NULL;
+    void *map = NULL;
+
+    if (nprocs == 0 || size == 0)
+        return EINVAL;
+
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp)
+        return ENOMEM;
+
+    tmp->fds = calloc(nprocs, sizeof(*tmp->fds));
+    if (!tmp->fds) {
+        free(tmp);
+        return ENOMEM;
+    }
+
+    for (size_t i = 0; i < nprocs; i++)
+        tmp->fds[i] = -1;
+    tmp->nprocs = nprocs;
+
+    /* Pages are only backed once written, so the size is only a limit. */
+    hlen = (hlen + page - 1) / page * page;
+    tmp->size = (size + page - 1) / page * page;
+    tmp->map = hlen + tmp->size * 2;
+    map = mmap(NULL, tmp->map, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        tmp->map = 0;
+        shm_free(tmp);
+        return errno;
+    }
+
+    tmp->hdr = map;
+    tmp->halves[0] = (unsigned char *) map + hlen;
+    tmp->halves[1] = tmp->halves[0] + tmp->size;
+
+    for (size_t i = 0; i < nprocs; i++) {
+        tmp->fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (tmp->fds[i] < 0) {
+            int r = errno;
+            shm_free(tmp);
+            return r;
+        }
+    }
+
+    *shm = tmp;
+    return 0;
+}
+
+void
+shm_free(shm_t *shm)
+{
+    if (!shm)
+        return;
+
+    for (size_t i = 0; i < shm->nprocs; i++) {
+        if (shm->fds[i] >= 0)
+            close(shm->fds[i]);
+    }
+
+    if (shm->map > 0)
+        munmap(shm->hdr, shm->map);
+
+    free(shm->fds);
+    free(shm);
+}
+
+void
+shm_attach(shm_t *shm, size_t slot)
+{
+    /* Other children's notifications are no concern of this one. */
+    for (size_t i = 0; i < shm->nprocs; i++) {
+        if (i != slot && shm->fds[i] >= 0) {
+            close(shm->fds[i]);
+            shm->fds[i] = -1;
+        }
+    }
+
+    shm->slot = slot;
+}
+
+int
+shm_fd(const shm_t *shm)
+{
+    return shm->fds[shm->slot];
+}
+
+static long
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+         + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* The next generation goes where the one before the latest was. Children
+ * that entered since the latest was published only read the latest, so
+ * once no child reads anything older, that half is free. */
+unsigned char *
+shm_begin(shm_t *shm, int wait, size_t *max)
+{
+    uint64_t gen = __atomic_load_n(&shm->hdr->gen, __ATOMIC_SEQ_CST);
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < shm->nprocs; i++) {
+        for (uint64_t g; (g = __atomic_load_n(&shm->hdr->active[i],
+                                              __ATOMIC_SEQ_CST)) != 0; ) {
+            if (g >= gen)
+                break;
+
+            if (elapsed(&start) >= wait) {
+                errno = EAGAIN;
+                return NULL;
+            }
+
+            sched_yield();
+        }
+    }
+
+    *max = shm->size;
+    return shm->halves[(gen + 1) % 2];
+}
+
+void
+shm_commit(shm_t *shm, size_t len)
+{
+    uint64_t gen = __atomic_load_n(&shm->hdr->gen, __ATOMIC_SEQ_CST) + 1;
+
+    shm->hdr->lens[gen % 2] = len;
+    __atomic_store_n(&shm->hdr->gen, gen, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < shm->nprocs; i++)
+        eventfd_write(shm->fds[i], 1);
+}
+
+/* Announces the generation before reading it, then checks that it is still
+ * the latest: if so, the parent can't have started overwriting it. */
+const unsigned char *
+shm_enter(shm_t *shm, uint64_t *gen, size_t *len)
+{
+    uint64_t *active = &shm->hdr->active[shm->slot];
+    uint64_t g;
+
+    do {
+        g = __atomic_load_n(&shm->hdr->gen, __ATOMIC_SEQ_CST);
+        __atomic_store_n(active, g, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&shm->hdr->gen, __ATOMIC_SEQ_CST) != g);
+
+    *gen = g;
+    *len = shm->hdr->lens[g % 2];
+    return shm->halves[g % 2];
+}
+
+void
+shm_leave(shm_t *shm)
+{
+    __atomic_store_n(&shm->hdr->active[shm->slot], 0, __ATOMIC_RELEASE);
+}
+
+void
+shm_reset(shm_t *shm, size_t slot)
+{
+    __atomic_store_n(&shm->hdr->active[slot], 0, __ATOMIC_SEQ_CST);
+}
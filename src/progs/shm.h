@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A memory region shared by a parent and the children it forks, holding the
+ * latest generation of something the parent publishes. Generations alternate
+ * between two halves, so the parent writes one while children may still be
+ * reading the other. Children don't lock: each announces the generation it is
+ * reading, and the parent only reuses a half once nobody reads it. */
+typedef struct shm shm_t;
+
+/* Creates a region for nprocs children, with size bytes per generation.
+ * Must be called before forking. */
+int
+shm_init(size_t nprocs, size_t size, shm_t **shm);
+
+void
+shm_free(shm_t *shm);
+
+/* Makes this process the child in slot, after fork(). */
+void
+shm_attach(shm_t *shm, size_t slot);
+
+/* Returns the child's notification fd, readable once a new generation is
+ * published. Read it to clear it. */
+int
+shm_fd(const shm_t *shm);
+
+/* Returns where the parent may write the next generation, and sets *max to
+ * its size. Waits at most wait ms for children to stop reading it: if they
+ * don't, returns NULL with errno set to EAGAIN. */
+unsigned char *
+shm_begin(shm_t *shm, int wait, size_t *max);
+
+/* Publishes the len bytes written since shm_begin() and notifies every
+ * child. */
+void
+shm_commit(shm_t *shm, size_t len);
+
+/* Returns the latest generation and its length, which stay valid until
+ * shm_leave(). Only one thread of a child may read at a time. */
+const unsigned char *
+shm_enter(shm_t *shm, uint64_t *gen, size_t *len);
+
+void
+shm_leave(shm_t *shm);
+
+/* Forgets what the child in slot was reading. Called once it has exited,
+ * so that a child that died while reading doesn't hold up the parent. */
+void
+shm_reset(shm_t *shm, size_t slot);
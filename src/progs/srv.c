@@ -19,120 +19,1340 @@
 #include "srv.h"
 #include "adv.h"
 #include "rec.h"
+#include "../mem.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/objects.h>
 
-#define NEVTS 5
+#define NEVTS SRV_BATCH
 
-int
-srv_main(const char *dbdir, int epoll, srv_req *req, srv_rep *rep,
-         void *misc, int timeout)
+/* What requests are answered from: a copy of the keys and the advertisement
+ * made from them. Snapshots are never changed once published. */
+typedef struct {
+    db_t *db;
+    adv_t *adv;
+} snap_t;
+
+/* A share of a batch's recovery requests. */
+typedef struct {
+    const db_t *db;
+    const pkt_rec_t *recs;
+    pkt_t **reps;
+    TANG_MSG_ERR *errs;
+    size_t n;
+    size_t *left;       /* Shares of the batch not yet done. */
+    int done;           /* Written when the last of them is. */
+} job_t;
+
+/* A bounded lock-free queue of jobs, for any number of producers and
+ * consumers. A cell is ready to be written when its sequence number equals
+ * the position being written, and to be read when it is one past it. */
+typedef struct {
+    struct cell {
+        size_t seq;
+        job_t *job;
+    } *cells;
+    size_t mask;
+    size_t head;
+    size_t tail;
+} queue_t;
+
+typedef struct {
+    srv_req *req;
+    srv_rep *rep;
+    const char *dbdir;
+    db_t *db;           /* Watches the directory; only the updater uses it. */
+    snap_t *snap;       /* Replaced as a whole when the keys change. */
+    shm_t *shm;         /* Where snapshots come from, instead of db. */
+    uint64_t gen;       /* The generation of snap in shm. */
+    uint64_t epoch;
+    uint64_t *active;   /* The epoch each worker began reading in, or zero. */
+    size_t nwrks;
+    size_t nevents;     /* Key changes seen by the updater. */
+    size_t nrebuilds;   /* Snapshots built because of them, or taken. */
+    int quiet;
+    int evict;          /* Seconds before unloading idle keys, or zero. */
+    int timeout;
+    int stop;
+    int sig;
+    queue_t jobs;       /* Recoveries waiting for a crypto thread. */
+    size_t ncrypto;
+    int crypto;         /* Counts the jobs queued, waking crypto threads. */
+    bool halt;
+} srv_t;
+
+typedef struct {
+    const srv_wrk_t *wrk;
+    uint64_t *active;
+    pthread_t thread;
+    srv_t *srv;
+    BN_CTX *ctx;
+    int done;           /* Wakes the worker when its recoveries are done. */
+    pkt_t *sreqs;       /* The spare batch's buffers, if it has one. */
+    pkt_t *sreps;
+    int r;
+} thr_t;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *locks;
+
+static void
+onlock(int mode, int n, const char *file, int line)
 {
-    struct epoll_event evts[NEVTS] = {};
-    BN_CTX *ctx = NULL;
-    adv_t *adv = NULL;
-    db_t *db = NULL;
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&locks[n]);
+    else
+        pthread_mutex_unlock(&locks[n]);
+}
+#endif
+
+static void
+snap_free(snap_t *snap)
+{
+    if (!snap)
+        return;
+
+    adv_free(snap->adv);
+    db_free(snap->db);
+    free(snap);
+}
+
+static int
+snap_new(const db_t *db, snap_t **snap)
+{
+    snap_t *tmp = NULL;
     int r;
 
-    OpenSSL_add_all_algorithms();
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp)
+        return ENOMEM;
+
+    r = db_copy(db, &tmp->db);
+    if (r == 0)
+        r = adv_init(&tmp->adv);
+    if (r == 0)
+        r = adv_update(tmp->adv, tmp->db);
+    if (r != 0) {
+        snap_free(tmp);
+        return r;
+    }
+
+    *snap = tmp;
+    return 0;
+}
+
+/* Writes the snapshot as children read it: the length of the keys, the keys
+ * and then the advertisement. Returns the number of bytes it takes; they are
+ * only written if they fit in max. */
+static size_t
+snap_save(const snap_t *snap, unsigned char *buf, size_t max)
+{
+    uint64_t dblen = db_save(snap->db, NULL, 0);
+    size_t len = sizeof(dblen) + dblen;
+
+    len += adv_save(snap->adv, NULL, 0);
+    if (len > max)
+        return len;
+
+    memcpy(buf, &dblen, sizeof(dblen));
+    db_save(snap->db, &buf[sizeof(dblen)], dblen);
+    adv_save(snap->adv, &buf[sizeof(dblen) + dblen],
+             len - sizeof(dblen) - dblen);
+    return len;
+}
+
+/* Makes a snapshot from the latest generation in shm, unless it is *gen.
+ * The result is a private copy, so a damaged generation can't hurt the
+ * snapshots already in use. Sets *snap to NULL if nothing changed. */
+static int
+snap_load(const char *dbdir, shm_t *shm, uint64_t *gen, snap_t **snap)
+{
+    const unsigned char *buf = NULL;
+    snap_t *tmp = NULL;
+    uint64_t dblen = 0;
+    uint64_t g = 0;
+    size_t len = 0;
+    int r = EINVAL;
+
+    *snap = NULL;
+    buf = shm_enter(shm, &g, &len);
+    if (g == *gen) {
+        shm_leave(shm);
+        return 0;
+    }
+
+    tmp = calloc(1, sizeof(*tmp));
+    if (!tmp) {
+        shm_leave(shm);
+        return ENOMEM;
+    }
+
+    if (len >= sizeof(dblen)) {
+        memcpy(&dblen, buf, sizeof(dblen));
+        if (dblen <= len - sizeof(dblen))
+            r = db_load(dbdir, &buf[sizeof(dblen)], dblen, &tmp->db);
+    }
+
+    if (r == 0)
+        r = adv_init(&tmp->adv);
+    if (r == 0)
+        r = adv_load(tmp->adv, tmp->db, &buf[sizeof(dblen) + dblen],
+                     len - sizeof(dblen) - dblen);
+
+    shm_leave(shm);
+    if (r != 0) {
+        snap_free(tmp);
+        return r;
+    }
+
+    *gen = g;
+    *snap = tmp;
+    return 0;
+}
+
+/* Announces that a worker is reading, then returns the current snapshot.
+ * The snapshot stays valid until the worker calls leave(). */
+static const snap_t *
+enter(srv_t *srv, uint64_t *active)
+{
+    __atomic_store_n(active, __atomic_load_n(&srv->epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&srv->snap, __ATOMIC_SEQ_CST);
+}
+
+static void
+leave(uint64_t *active)
+{
+    __atomic_store_n(active, 0, __ATOMIC_RELEASE);
+}
+
+/* Waits until every worker that might have seen the previous snapshot has
+ * left it. Readers that enter from now on can only see the new one. */
+static void
+synchronize(srv_t *srv)
+{
+    uint64_t epoch = __atomic_add_fetch(&srv->epoch, 1, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < srv->nwrks; i++) {
+        for (uint64_t e; (e = __atomic_load_n(&srv->active[i],
+                                              __ATOMIC_SEQ_CST)) != 0; ) {
+            if (e >= epoch)
+                break;
+
+            sched_yield();
+        }
+    }
+}
+
+static long
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+         + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Collects key changes until the directory has been quiet for a while, then
+ * applies them all at once and publishes the result. A burst of changes
+ * (say, tang-gen writing a file and setting its attributes) thus costs one
+ * rebuild, and requests keep being answered from the old snapshot. */
+static int
+update(srv_t *srv)
+{
+    struct pollfd pfds[] = {
+        { .fd = srv->db->fd, .events = POLLIN },
+        { .fd = srv->stop, .events = POLLIN },
+    };
+    size_t nevents = srv->db->nevents;
+    snap_t *snap = NULL;
+    struct timespec start;
+    int ret;
+    int r;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long wait; ; ) {
+        r = db_event(srv->db);
+        if (r != 0)
+            return r;
+
+        /* Don't let a steady trickle of changes put off rebuilding forever. */
+        wait = (long) srv->quiet * SRV_QUIET_MAX - elapsed(&start);
+        if (wait > srv->quiet)
+            wait = srv->quiet;
+        if (wait <= 0)
+            break;
+
+        r = poll(pfds, sizeof(pfds) / sizeof(*pfds), wait);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0 || (pfds[1].revents & POLLIN))
+            break;
+    }
+
+    srv->nevents += srv->db->nevents - nevents;
+    if (srv->db->nchgs == 0 && !srv->db->rescan)
+        return 0;
+
+    /* Files that fail to load are reported, but the rest still count. */
+    ret = db_apply(srv->db);
+
+    r = snap_new(srv->db, &snap);
+    if (r != 0)
+        return r;
+
+    snap = __atomic_exchange_n(&srv->snap, snap, __ATOMIC_SEQ_CST);
+    synchronize(srv);
+    snap_free(snap);
+    srv->nrebuilds++;
+
+    /* A parent of forked children saves once it has published instead. */
+    if (!srv->shm)
+        adv_cache(srv->snap->adv, srv->db);
+    return ret;
+}
+
+/* Takes the snapshot the parent has published, if it is a new one. */
+static int
+reload(srv_t *srv)
+{
+    snap_t *snap = NULL;
+    eventfd_t cnt;
+    int r;
+
+    eventfd_read(shm_fd(srv->shm), &cnt);
+
+    r = snap_load(srv->dbdir, srv->shm, &srv->gen, &snap);
+    if (r != 0 || !snap)
+        return r;
+
+    snap = __atomic_exchange_n(&srv->snap, snap, __ATOMIC_SEQ_CST);
+    synchronize(srv);
+    snap_free(snap);
+    srv->nrebuilds++;
+    return 0;
+}
+
+/* Unloads the private keys that have been idle for a while. Every snapshot
+ * shares them with srv->db, and a worker may be using one right now, so
+ * they are freed only once the workers have moved on. A child has no
+ * srv->db; only the updater replaces snapshots, so it uses the current one.
+ */
+static void
+evict(srv_t *srv)
+{
+    const db_t *db = srv->db ? srv->db : srv->snap->db;
+    EC_KEY *dead[SRV_EVICT_BATCH];
+    size_t n;
+
+    do {
+        n = db_evict(db, srv->evict, dead, SRV_EVICT_BATCH);
+        if (n == 0)
+            break;
+
+        synchronize(srv);
+        for (size_t i = 0; i < n; i++)
+            EC_KEY_free(dead[i]);
+    } while (n == SRV_EVICT_BATCH);
+}
+
+/* Frees the reply cache entries that the advertisement has replaced, once
+ * no worker can still be sending from them. Only the updater replaces
+ * snapshots, so it can use the current one. */
+static void
+reclaim(srv_t *srv)
+{
+    void *dead[SRV_EVICT_BATCH];
+    size_t n;
+
+    do {
+        n = adv_retired(srv->snap->adv, dead, SRV_EVICT_BATCH);
+        if (n == 0)
+            break;
+
+        synchronize(srv);
+        for (size_t i = 0; i < n; i++)
+            free(dead[i]);
+    } while (n == SRV_EVICT_BATCH);
+}
+
+/* Tells the operator how many rebuilds waiting for quiet saved. A burst
+ * of events costs one rebuild, so the difference is what it avoided. */
+static void
+report(const srv_t *srv)
+{
+    if (srv->nevents == 0)
+        return;
+
+    fprintf(stderr, "Key changes: %zu events, %zu rebuilds (%zu avoided)\n",
+            srv->nevents, srv->nrebuilds,
+            srv->nevents > srv->nrebuilds ? srv->nevents - srv->nrebuilds : 0);
+}
+
+static void *
+updater(void *arg)
+{
+    srv_t *srv = arg;
+    struct pollfd pfds[] = {
+        { .fd = srv->db ? srv->db->fd : shm_fd(srv->shm), .events = POLLIN },
+        { .fd = srv->stop, .events = POLLIN },
+    };
+    struct timespec evicted;
 
+    /* The workers are already answering from the first snapshot. */
+    if (srv->db)
+        adv_cache(srv->snap->adv, srv->db);
+
+    clock_gettime(CLOCK_MONOTONIC, &evicted);
+    while (!(pfds[1].revents & POLLIN)) {
+        long wait = -1;
+        int r;
+
+        /* Evict on schedule, however busy the directory keeps us. */
+        if (srv->evict > 0) {
+            wait = srv->evict * 1000L - elapsed(&evicted);
+            if (wait <= 0) {
+                evict(srv);
+                clock_gettime(CLOCK_MONOTONIC, &evicted);
+                wait = srv->evict * 1000L;
+            }
+        }
+
+        reclaim(srv);
+        if (wait < 0 || wait > SRV_RECLAIM)
+            wait = SRV_RECLAIM;
+
+        r = poll(pfds, sizeof(pfds) / sizeof(*pfds),
+                 wait < INT_MAX ? wait : INT_MAX);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
+        if ((srv->db ? update(srv) : reload(srv)) != 0)
+            fprintf(stderr, "Error updating advertisement!\n");
+    }
+
+    report(srv);
+    mem_flush();
+    return NULL;
+}
+
+static int
+queue_init(queue_t *q, size_t min)
+{
+    size_t size = 1;
+
+    while (size < min)
+        size *= 2;
+
+    q->cells = calloc(size, sizeof(*q->cells));
+    if (!q->cells)
+        return ENOMEM;
+
+    for (size_t i = 0; i < size; i++)
+        q->cells[i].seq = i;
+
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+    return 0;
+}
+
+/* Adds a job to the queue. Returns false if it is full. */
+static bool
+enqueue(queue_t *q, job_t *job)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct cell *c;
+
+    for (;;) {
+        intptr_t dif;
+
+        c = &q->cells[pos & q->mask];
+        dif = (intptr_t) __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)
+            - (intptr_t) pos;
+
+        if (dif < 0)
+            return false;
+
+        if (dif > 0)
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+            break;
+    }
+
+    c->job = job;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Takes the oldest job from the queue, or returns NULL if it is empty. */
+static job_t *
+dequeue(queue_t *q)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct cell *c;
+    job_t *job;
+
+    for (;;) {
+        intptr_t dif;
+
+        c = &q->cells[pos & q->mask];
+        dif = (intptr_t) __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)
+            - (intptr_t) (pos + 1);
+
+        if (dif < 0)
+            return NULL;
+
+        if (dif > 0)
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+            break;
+    }
+
+    job = c->job;
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+static void
+run(job_t *job, BN_CTX *ctx)
+{
+    int done = job->done;
+
+    rec_decrypt(job->db, job->recs, job->reps, job->errs, job->n, ctx);
+
+    /* Once the count drops to zero, the job may be gone. */
+    if (__atomic_sub_fetch(job->left, 1, __ATOMIC_ACQ_REL) == 0)
+        eventfd_write(done, 1);
+}
+
+static int
+reply(srv_t *srv, thr_t *thr, const snap_t *snap, int sock, const pkt_t *in,
+      pkt_t *out, size_t n, void *misc, bool spare);
+
+/* Waits for a batch's recoveries to be done, helping with whatever is still
+ * queued. If sock is given, batches arriving on it meanwhile are read into
+ * the spare buffers and answered, so that quick requests don't wait behind
+ * the recoveries; those batches' own recoveries are waited for in turn.
+ * Wakeups meant for other batches are harmless, as left is checked again. */
+static int
+await(srv_t *srv, thr_t *thr, const snap_t *snap, int sock, size_t *left)
+{
+    struct pollfd pfds[] = {
+        { .fd = thr->done, .events = POLLIN },
+        { .fd = sock, .events = POLLIN },
+    };
+    int r = 0;
+
+    while (__atomic_load_n(left, __ATOMIC_ACQUIRE) > 0) {
+        size_t npkts = SRV_BATCH;
+        eventfd_t cnt;
+        job_t *job;
+
+        /* Look for requests between jobs, without waiting for them. */
+        if (poll(&pfds[1], 1, 0) <= 0) {
+            job = dequeue(&srv->jobs);
+            if (job) {
+                run(job, thr->ctx);
+                continue;
+            }
+
+            if (poll(pfds, 2, -1) <= 0)
+                continue;
+
+            if (pfds[0].revents & POLLIN)
+                eventfd_read(thr->done, &cnt);
+
+            if (!(pfds[1].revents & POLLIN))
+                continue;
+        }
+
+        r = srv->req(sock, thr->sreqs, &npkts, thr->wrk->spare);
+        if (r == EAGAIN) {
+            r = 0;
+            continue;
+        }
+
+        if (r == 0 && npkts > 0)
+            r = reply(srv, thr, snap, sock, thr->sreqs, thr->sreps, npkts,
+                      thr->wrk->spare, false);
+
+        /* Leave the rest to the event loop, which reports any error. */
+        if (r != 0 || npkts == 0)
+            pfds[1].fd = -1;
+    }
+
+    return r;
+}
+
+/* Answers recovery requests, sharing them out to the crypto threads. The
+ * worker does a share itself, unless it has a socket to read meanwhile, and
+ * helps with whatever is still queued. */
+static int
+decrypt(srv_t *srv, thr_t *thr, const snap_t *snap, int sock,
+        const pkt_rec_t *recs, pkt_t **reps, TANG_MSG_ERR *errs, size_t n)
+{
+    size_t parts = srv->ncrypto + 1 < n ? srv->ncrypto + 1 : n;
+    size_t left = parts;
+    size_t queued = 0;
+
+    if (parts <= 1) {
+        rec_decrypt(snap->db, recs, reps, errs, n, thr->ctx);
+        return 0;
+    }
+
+    job_t jobs[parts];
+
+    for (size_t i = 0, off = 0; i < parts; i++) {
+        size_t m = (n - off) / (parts - i);
+
+        jobs[i] = (job_t) {
+            .db = snap->db, .recs = &recs[off], .reps = &reps[off],
+            .errs = &errs[off], .n = m, .left = &left, .done = thr->done
+        };
+
+        off += m;
+    }
+
+    /* A full queue just means doing more of the work here. */
+    for (size_t i = sock < 0 ? 1 : 0; i < parts; i++) {
+        if (enqueue(&srv->jobs, &jobs[i]))
+            queued++;
+        else
+            run(&jobs[i], thr->ctx);
+    }
+
+    if (queued > 0)
+        eventfd_write(srv->crypto, queued);
+
+    if (sock < 0)
+        run(&jobs[0], thr->ctx);
+
+    return await(srv, thr, snap, sock, &left);
+}
+
+static void *
+cryptor(void *arg)
+{
+    srv_t *srv = arg;
+    BN_CTX *ctx = NULL;
+
+    /* Without a context of its own, a thread just leaves its share of the
+     * work to the workers. */
     ctx = BN_CTX_new();
     if (!ctx)
-        return ENOMEM;
+        return NULL;
+
+    while (!__atomic_load_n(&srv->halt, __ATOMIC_ACQUIRE)) {
+        eventfd_t cnt;
+        job_t *job;
+
+        if (eventfd_read(srv->crypto, &cnt) != 0)
+            continue;
+
+        while ((job = dequeue(&srv->jobs)))
+            run(job, ctx);
+    }
+
+    BN_CTX_free(ctx);
+    mem_flush();
+    return NULL;
+}
+
+/* Answers a batch of raw requests from snap and sends the replies, using
+ * misc for the callbacks. Recovery requests are answered together so that
+ * they can share work, but only after the other replies in the batch have
+ * been sent: recoveries take much longer. While they are being done, more
+ * batches may be read into the spare buffers, if spare. Undecodable
+ * requests get no reply at all. */
+static int
+reply(srv_t *srv, thr_t *thr, const snap_t *snap, int sock, const pkt_t *in,
+      pkt_t *out, size_t n, void *misc, bool spare)
+{
+    const srv_wrk_t *wrk = thr->wrk;
+    bool ordered = wrk->ordered && wrk->ordered(sock, misc);
+    TANG_MSG_ERR errs[n];
+    TANG_MSG *msgs[n];
+    pkt_rec_t recs[n];
+    size_t idxs[n];
+    pkt_t *reps[n];
+    size_t nrecs = 0;
+    int r = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const TANG_MSG_REC_REQ *rec = NULL;
+        pkt_adv_t adv;
+
+        out[i].size = 0;
+        errs[i] = TANG_MSG_ERR_NONE;
+        msgs[i] = NULL;
+
+        /* Most requests are for recovery, so try viewing them in place. */
+        if (pkt_parse_rec(&in[i], &recs[nrecs]) == 0) {
+            idxs[nrecs] = i;
+            reps[nrecs++] = &out[i];
+            continue;
+        }
+
+        /* Advertisement filters are normalized and bounded up front. */
+        r = pkt_parse_adv(&in[i], &adv);
+        if (r != EINVAL) {
+            errs[i] = r == 0 ? adv_sign(snap->adv, &adv, &out[i])
+                             : TANG_MSG_ERR_INVALID_REQUEST;
+            continue;
+        }
 
-    /* Open database. */
-    r = db_open(dbdir, &db);
+        msgs[i] = d2i_TANG_MSG(NULL, &(const uint8_t *) { in[i].data },
+                               in[i].size);
+        if (!msgs[i])
+            continue;
+
+        switch (msgs[i]->type) {
+        case TANG_MSG_TYPE_ADV_REQ:
+            if (pkt_norm_adv(msgs[i]->val.adv.req, &adv) == 0)
+                errs[i] = adv_sign(snap->adv, &adv, &out[i]);
+            else
+                errs[i] = TANG_MSG_ERR_INVALID_REQUEST;
+            break;
+
+        case TANG_MSG_TYPE_REC_REQ:
+            rec = msgs[i]->val.rec.req;
+            recs[nrecs] = (pkt_rec_t) {
+                .grp = OBJ_obj2nid(rec->key->grp),
+                .key = rec->key->key->data,
+                .keylen = rec->key->key->length,
+                .x = rec->x->data,
+                .xlen = rec->x->length,
+            };
+            idxs[nrecs] = i;
+            reps[nrecs++] = &out[i];
+            break;
+
+        default:
+            errs[i] = TANG_MSG_ERR_INVALID_REQUEST;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (errs[i] != TANG_MSG_ERR_NONE)
+            pkt_err(&out[i], errs[i]);
+    }
+
+    /* Send what is ready. Ordered workers can only send up to the first
+     * recovery. */
+    r = 0;
+    if (nrecs > 0 && nrecs < n) {
+        size_t ready = ordered ? idxs[0] : n;
+
+        if (ready > 0)
+            r = srv->rep(sock, out, ready, misc);
+
+        for (size_t i = 0; i < ready; i++)
+            out[i].size = 0;
+    }
+
+    spare = spare && !ordered && thr->sreqs;
+
+    TANG_MSG_ERR recerrs[nrecs + 1];
+    if (r == 0)
+        r = decrypt(srv, thr, snap, spare ? sock : -1, recs, reps, recerrs,
+                    nrecs);
+
+    for (size_t i = 0; i < n; i++)
+        TANG_MSG_free(msgs[i]);
+
+    for (size_t j = 0; r == 0 && j < nrecs; j++) {
+        if (recerrs[j] != TANG_MSG_ERR_NONE)
+            pkt_err(reps[j], recerrs[j]);
+    }
+
+    if (r == 0)
+        r = srv->rep(sock, out, n, misc);
+
+    return r;
+}
+
+/* Answers a batch of raw requests, all from the current snapshot. */
+static int
+answer(srv_t *srv, thr_t *thr, int sock, const pkt_t *in, pkt_t *out,
+       size_t n)
+{
+    const snap_t *snap = enter(srv, thr->active);
+    int r;
+
+    r = reply(srv, thr, snap, sock, in, out, n, thr->wrk->misc, true);
+
+    /* Cached replies are sent from the snapshot, so leave it only after. */
+    leave(thr->active);
+    return r;
+}
+
+/* Runs one worker's event loop. Only the main worker honors the idle
+ * timeout; the others run until told to stop. */
+static int
+work(thr_t *thr, bool main)
+{
+    const srv_wrk_t *wrk = thr->wrk;
+    srv_t *srv = thr->srv;
+    struct epoll_event evts[NEVTS] = {};
+    int timeout = main ? srv->timeout : -1;
+    size_t nbufs = SRV_BATCH;
+    pkt_t *reqs = NULL;
+    pkt_t *reps = NULL;
+    int r = 0;
+
+    /* Each worker keeps its own pool of buffers for the life of the loop,
+     * with a second batch's worth if it reads while recoveries are done. */
+    if (wrk->spare && srv->ncrypto > 0)
+        nbufs *= 2;
+
+    reqs = calloc(nbufs, sizeof(*reqs));
+    reps = calloc(nbufs, sizeof(*reps));
+    if (!reqs || !reps) {
+        r = ENOMEM;
+        goto egress;
+    }
+
+    for (size_t i = 0; i < nbufs && r == 0; i++) {
+        r = pkt_init(&reqs[i]);
+        if (r == 0)
+            r = pkt_init(&reps[i]);
+    }
+    if (r != 0)
+        goto egress;
+
+    if (nbufs > SRV_BATCH) {
+        thr->sreqs = &reqs[SRV_BATCH];
+        thr->sreps = &reps[SRV_BATCH];
+    }
+
+    for (int nevts; (nevts = epoll_wait(wrk->epoll, evts, NEVTS, timeout)) != 0; ) {
+        /* Pending io_uring completions can interrupt the wait. */
+        if (nevts < 0) {
+            if (errno == EINTR)
+                continue;
+
+            r = errno;
+            break;
+        }
+
+        for (int i = 0; i < nevts; i++) {
+            size_t npkts = 0;
+
+            if (evts[i].data.fd == srv->stop || evts[i].data.fd == srv->sig)
+                goto egress;
+
+            /* Answer whole batches until the socket runs dry. */
+            do {
+                npkts = SRV_BATCH;
+                r = srv->req(evts[i].data.fd, reqs, &npkts, wrk->misc);
+                if (r == EAGAIN)
+                    break;
+                if (r != 0 || npkts == 0)
+                    goto egress;
+
+                r = answer(srv, thr, evts[i].data.fd, reqs, reps, npkts);
+                if (r != 0)
+                    goto egress;
+            } while (npkts == SRV_BATCH);
+        }
+    }
+
+egress:
+    thr->sreqs = thr->sreps = NULL;
+    for (size_t i = 0; i < nbufs; i++) {
+        if (reqs)
+            pkt_cleanup(&reqs[i]);
+        if (reps)
+            pkt_cleanup(&reps[i]);
+    }
+
+    free(reqs);
+    free(reps);
+    return r == EAGAIN ? 0 : r;
+}
+
+static void *
+thread(void *arg)
+{
+    thr_t *thr = arg;
+
+    thr->r = work(thr, false);
+    mem_flush();
+    return NULL;
+}
+
+/* Prepares libcrypto for the threads that use it. */
+static int
+setup(void)
+{
+    int r;
+
+    /* Recycle the objects each request allocates, in a cache per thread.
+     * This must come before anything else uses libcrypto. */
+    r = mem_init();
+    if (r != 0)
+        return r;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    /* Advertisements are signed by several threads, so always lock. */
+    if (!CRYPTO_get_locking_callback()) {
+        locks = calloc(CRYPTO_num_locks(), sizeof(*locks));
+        if (!locks)
+            return ENOMEM;
+
+        for (int i = 0; i < CRYPTO_num_locks(); i++)
+            pthread_mutex_init(&locks[i], NULL);
+
+        CRYPTO_set_locking_callback(onlock);
+    }
+#endif
+
+    OpenSSL_add_all_algorithms();
+    return 0;
+}
+
+int
+srv_main(const char *dbdir, const srv_wrk_t *wrks, size_t nwrks,
+         srv_req *req, srv_rep *rep, int timeout, int quiet, int evict,
+         size_t ncrypto, shm_t *shm)
+{
+    srv_t srv = {
+        .req = req, .rep = rep, .timeout = timeout, .stop = -1, .sig = -1,
+        .nwrks = nwrks, .epoch = 1, .quiet = quiet, .evict = evict,
+        .ncrypto = ncrypto, .crypto = -1, .dbdir = dbdir, .shm = shm
+    };
+    pthread_t *crys = NULL;
+    pthread_t upd;
+    bool updating = false;
+    thr_t *thrs = NULL;
+    size_t ncrys = 0;
+    size_t nthrs = 1;
+    sigset_t term;
+    sigset_t all;
+    sigset_t cur;
+    sigset_t old;
+    int r;
+
+    if (nwrks == 0)
+        return EINVAL;
+
+    r = setup();
+    if (r != 0)
+        return r;
+
+    thrs = calloc(nwrks, sizeof(*thrs));
+    crys = calloc(ncrypto + 1, sizeof(*crys));
+    srv.active = calloc(nwrks, sizeof(*srv.active));
+    if (!thrs || !crys || !srv.active) {
+        r = ENOMEM;
+        goto egress;
+    }
+
+    for (size_t i = 0; i < nwrks; i++) {
+        thrs[i] = (thr_t) {
+            .srv = &srv, .wrk = &wrks[i], .active = &srv.active[i],
+            .ctx = BN_CTX_new(), .done = -1
+        };
+    }
+
+    for (size_t i = 0; i < nwrks; i++) {
+        if (!thrs[i].ctx) {
+            r = ENOMEM;
+            goto egress;
+        }
+    }
+
+    /* Set up the crypto threads' queue. Each worker has at most two batches
+     * in it at a time: one, and another read while waiting for it. */
+    if (ncrypto > 0) {
+        r = queue_init(&srv.jobs, nwrks * (ncrypto + 1) * 2);
+        if (r != 0)
+            goto egress;
+
+        srv.crypto = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+        if (srv.crypto < 0) {
+            r = errno;
+            goto egress;
+        }
+
+        for (size_t i = 0; i < nwrks; i++) {
+            thrs[i].done = eventfd(0, EFD_CLOEXEC);
+            if (thrs[i].done < 0) {
+                r = errno;
+                goto egress;
+            }
+        }
+    }
+
+    /* Open database and create the first snapshot, or take the parent's. */
+    if (shm) {
+        r = snap_load(dbdir, shm, &srv.gen, &srv.snap);
+    } else {
+        r = db_open(dbdir, &srv.db);
+        if (r == 0)
+            r = snap_new(srv.db, &srv.snap);
+    }
     if (r != 0)
         goto egress;
 
-    r = epoll_ctl(epoll, EPOLL_CTL_ADD, db->fd, &(struct epoll_event) {
-        .events = EPOLLIN | EPOLLRDHUP | EPOLLPRI,
-        .data.fd = db->fd
+    /* Create the stop event, which wakes every worker on shutdown. */
+    srv.stop = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (srv.stop < 0) {
+        r = errno;
+        goto egress;
+    }
+
+    for (size_t i = 0; i < nwrks; i++) {
+        r = epoll_ctl(wrks[i].epoll, EPOLL_CTL_ADD, srv.stop, &(struct epoll_event) {
+            .events = EPOLLIN,
+            .data.fd = srv.stop
+        });
+        if (r != 0) {
+            r = errno;
+            goto egress;
+        }
+    }
+
+    /* Shut down cleanly on SIGTERM and SIGINT. */
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigaddset(&term, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &term, &old);
+
+    srv.sig = signalfd(-1, &term, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (srv.sig < 0) {
+        r = errno;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        goto egress;
+    }
+
+    r = epoll_ctl(wrks[0].epoll, EPOLL_CTL_ADD, srv.sig, &(struct epoll_event) {
+        .events = EPOLLIN,
+        .data.fd = srv.sig
     });
     if (r != 0) {
         r = errno;
         goto egress;
     }
 
-    /* Create ADV state. */
-    r = adv_init(&adv);
+    /* Start the updater, the crypto threads and the additional workers.
+     * Signals are left to the main thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &cur);
+    r = pthread_create(&upd, NULL, updater, &srv);
+    updating = r == 0;
+    for (; r == 0 && ncrys < ncrypto; ncrys++) {
+        r = pthread_create(&crys[ncrys], NULL, cryptor, &srv);
+        if (r != 0)
+            break;
+    }
+    for (; r == 0 && nthrs < nwrks; nthrs++) {
+        r = pthread_create(&thrs[nthrs].thread, NULL, thread, &thrs[nthrs]);
+        if (r != 0)
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &cur, NULL);
+
+    /* Main loop. */
+    if (r == 0)
+        r = work(&thrs[0], true);
+
+    eventfd_write(srv.stop, 1);
+    for (size_t i = 1; i < nthrs; i++) {
+        pthread_join(thrs[i].thread, NULL);
+        if (r == 0)
+            r = thrs[i].r;
+    }
+
+    /* With the workers gone, nothing is queued any more. */
+    __atomic_store_n(&srv.halt, true, __ATOMIC_RELEASE);
+    if (ncrys > 0)
+        eventfd_write(srv.crypto, ncrys);
+    for (size_t i = 0; i < ncrys; i++)
+        pthread_join(crys[i], NULL);
+
+    if (updating)
+        pthread_join(upd, NULL);
+
+egress:
+    if (srv.sig >= 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        close(srv.sig);
+    }
+
+    if (srv.stop >= 0)
+        close(srv.stop);
+
+    if (srv.crypto >= 0)
+        close(srv.crypto);
+
+    for (size_t i = 0; thrs && i < nwrks; i++) {
+        if (thrs[i].done >= 0)
+            close(thrs[i].done);
+        BN_CTX_free(thrs[i].ctx);
+    }
+
+    snap_free(srv.snap);
+    db_free(srv.db);
+    free(srv.jobs.cells);
+    free(srv.active);
+    free(crys);
+    free(thrs);
+
+    EVP_cleanup();
+    return r;
+}
+
+/* Writes the current snapshot for the children. Returns EAGAIN if some of
+ * them are still reading the generation it would replace. */
+static int
+publish(srv_t *srv)
+{
+    unsigned char *buf = NULL;
+    size_t max = 0;
+    size_t len;
+
+    buf = shm_begin(srv->shm, SRV_SHM_WAIT, &max);
+    if (!buf)
+        return errno;
+
+    len = snap_save(srv->snap, buf, max);
+    if (len > max)
+        return E2BIG;
+
+    shm_commit(srv->shm, len);
+    return 0;
+}
+
+/* Forks the child for slot. It starts with the signals the caller had
+ * before srv_prefork() blocked them, drops the parent's keys, including the
+ * private ones, and is stopped if the parent dies. */
+static pid_t
+spawn(srv_t *srv, size_t slot, srv_child *child, void *misc,
+      const sigset_t *old)
+{
+    pid_t ppid = getpid();
+    pid_t pid;
+    int r;
+
+    pid = fork();
+    if (pid != 0)
+        return pid;
+
+    close(srv->sig);
+    snap_free(srv->snap);
+    db_free(srv->db);
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) != 0 || getppid() != ppid)
+        exit(EXIT_FAILURE);
+
+    shm_attach(srv->shm, slot);
+    r = child(srv->shm, slot, misc);
+    exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void
+kill_all(const pid_t *pids, size_t nprocs)
+{
+    for (size_t i = 0; i < nprocs; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+}
+
+int
+srv_prefork(const char *dbdir, size_t nprocs, int quiet,
+            srv_child *child, void *misc)
+{
+    srv_t srv = { .stop = -1, .sig = -1, .epoch = 1, .quiet = quiet };
+    bool pending = false;
+    bool stopping = false;
+    pid_t *pids = NULL;
+    size_t nlive = 0;
+    sigset_t sigs;
+    sigset_t old;
+    int r;
+
+    if (nprocs == 0)
+        return EINVAL;
+
+    r = setup();
+    if (r != 0)
+        return r;
+
+    pids = calloc(nprocs, sizeof(*pids));
+    if (!pids)
+        return ENOMEM;
+
+    r = shm_init(nprocs, SRV_SHM, &srv.shm);
     if (r != 0)
         goto egress;
 
-    r = adv_update(adv, db, ctx);
+    /* Read and sign once, here, for every child. */
+    r = db_open(dbdir, &srv.db);
+    if (r == 0)
+        r = snap_new(srv.db, &srv.snap);
+    if (r == 0)
+        r = publish(&srv);
     if (r != 0)
         goto egress;
 
-    /* Main loop. */
-    for (int nevts; (nevts = epoll_wait(epoll, evts, NEVTS, timeout)) > 0; ) {
-        for (int i = 0; i < nevts; i++) {
-            TANG_MSG_ERR err = TANG_MSG_ERR_NONE;
-            TANG_MSG *msg = NULL;
-            pkt_t pkt = {};
-
-            if (evts[i].data.fd == db->fd) {
-                r = db_event(db);
-                if (r == 0)
-                    r = adv_update(adv, db, ctx);
-                if (r != 0)
-                    fprintf(stderr, "Error updating advertisement!\n");
-                continue;
-            }
+    /* Signals arrive on an fd, which also cuts short waiting for quiet. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old);
 
-            r = req(evts[i].data.fd, &msg, misc);
-            if (r != 0 || !msg) {
-                if (r == EAGAIN)
-                    continue;
+    srv.sig = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (srv.sig < 0) {
+        r = errno;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        goto egress;
+    }
+    srv.stop = srv.sig;
 
-                return r;
-            }
+    for (; nlive < nprocs; nlive++) {
+        pids[nlive] = spawn(&srv, nlive, child, misc, &old);
+        if (pids[nlive] < 0) {
+            r = errno;
+            stopping = true;
+            kill_all(pids, nprocs);
+            break;
+        }
+    }
+    if (!stopping)
+        adv_cache(srv.snap->adv, srv.db);
 
-            switch (msg->type) {
-            case TANG_MSG_TYPE_ADV_REQ:
-                err = adv_sign(adv, msg->val.adv.req, &pkt);
-                break;
+    while (nlive > 0) {
+        struct pollfd pfds[] = {
+            { .fd = stopping ? -1 : srv.db->fd, .events = POLLIN },
+            { .fd = srv.sig, .events = POLLIN },
+        };
+        struct signalfd_siginfo si;
+        int status;
+        int n;
 
-            case TANG_MSG_TYPE_REC_REQ:
-                err = rec_decrypt(db, msg->val.rec.req, &pkt, ctx);
-                break;
+        /* Retry publishing until the children let go of the old half. */
+        n = poll(pfds, sizeof(pfds) / sizeof(*pfds),
+                 pending ? SRV_SHM_WAIT : -1);
+        if (n < 0 && errno != EINTR) {
+            r = errno;
+            stopping = true;
+            kill_all(pids, nprocs);
+            continue;
+        }
 
-            default:
-                err = TANG_MSG_ERR_INVALID_REQUEST;
-                break;
+        if (pfds[0].revents & POLLIN) {
+            size_t nrebuilds = srv.nrebuilds;
+
+            if (update(&srv) != 0)
+                fprintf(stderr, "Error updating advertisement!\n");
+
+            pending |= srv.nrebuilds != nrebuilds;
+        }
+
+        while (read(srv.sig, &si, sizeof(si)) == sizeof(si)) {
+            if (si.ssi_signo != SIGCHLD && !stopping) {
+                stopping = true;
+                kill_all(pids, nprocs);
             }
+        }
 
-            TANG_MSG_free(msg);
-
-            if (err != TANG_MSG_ERR_NONE) {
-                r = pkt_encode((ASN1_VALUE *) &(TANG_MSG) {
-                    .type = TANG_MSG_TYPE_ERR,
-                    .val.err = &(ASN1_ENUMERATED) {
-                        .data = &(unsigned char) { err },
-                        .type = V_ASN1_ENUMERATED,
-                        .length = 1,
-                    }
-                }, &TANG_MSG_it, &pkt);
-                if (r != 0)
-                    pkt.size = 0;
+        for (pid_t pid; (pid = waitpid(-1, &status, WNOHANG)) > 0; ) {
+            size_t i = 0;
+
+            while (i < nprocs && pids[i] != pid)
+                i++;
+            if (i == nprocs)
+                continue;
+
+            shm_reset(srv.shm, i);
+            pids[i] = 0;
+            nlive--;
+            if (stopping)
+                continue;
+
+            /* A child only exits by itself if it can't serve at all. */
+            if (!WIFSIGNALED(status)) {
+                r = ECHILD;
+                stopping = true;
+                kill_all(pids, nprocs);
+                continue;
             }
 
-            if (pkt.size > 0) {
-                r = rep(evts[i].data.fd, &pkt, misc);
-                if (r != 0)
-                    goto egress;
+            fprintf(stderr, "Worker process %d killed by signal %d\n",
+                    pid, WTERMSIG(status));
+
+            pids[i] = spawn(&srv, i, child, misc, &old);
+            if (pids[i] < 0) {
+                r = errno;
+                stopping = true;
+                kill_all(pids, nprocs);
+                continue;
             }
+
+            nlive++;
+        }
+
+        if (pending && !stopping) {
+            int err = publish(&srv);
+
+            if (err != EAGAIN)
+                pending = false;
+            if (err == 0)
+                adv_cache(srv.snap->adv, srv.db);
+            if (err != 0 && err != EAGAIN)
+                fprintf(stderr, "Error publishing advertisement: %s\n",
+                        strerror(err));
         }
     }
 
+    report(&srv);
+
 egress:
-    BN_CTX_free(ctx);
-    adv_free(adv);
-    db_free(db);
+    if (srv.sig >= 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        close(srv.sig);
+    }
+
+    snap_free(srv.snap);
+    db_free(srv.db);
+    shm_free(srv.shm);
+    free(pids);
 
     EVP_cleanup();
     return r;
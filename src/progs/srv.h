@@ -20,10 +20,75 @@
 
 #include "../asn1.h"
 #include "../pkt.h"
+#include "shm.h"
 
-typedef int srv_req(int sock, TANG_MSG **req, void *misc);
-typedef int srv_rep(int sock, const pkt_t *pkt, void *misc);
+#include <stdbool.h>
 
+#define SRV_BATCH 32
+#define SRV_QUIET 20        /* Default quiet period for key changes, in ms. */
+#define SRV_QUIET_MAX 10    /* Longest wait for quiet, in quiet periods. */
+#define SRV_EVICT_BATCH 64  /* Most keys or entries freed per grace period. */
+#define SRV_RECLAIM 1000    /* How often old cache entries are freed, in ms. */
+#define SRV_SHM (16 << 20)  /* Largest snapshot shared with children. */
+#define SRV_SHM_WAIT 100    /* Longest wait for children to let go, in ms. */
+
+/* Receives up to *npkts raw requests into pkts and sets *npkts to the number
+ * received. Returns EAGAIN if nothing is ready. Returning zero with *npkts
+ * set to zero means the peer has gone away. */
+typedef int srv_req(int sock, pkt_t *pkts, size_t *npkts, void *misc);
+
+/* Sends the replies to a batch of requests: pkts[i] answers the i-th request
+ * of the last call to srv_req. Requests without a reply have a zero size.
+ * A batch's replies may be sent over several calls: those already sent are
+ * then given a zero size, and npkts may stop short of the end of the batch. */
+typedef int srv_rep(int sock, const pkt_t *pkts, size_t npkts, void *misc);
+
+/* Returns whether replies on sock must go out in the order of its requests,
+ * as on a stream. */
+typedef bool srv_ord(int sock, void *misc);
+
+/* A worker thread: its own epoll set and its own callback state. Without
+ * an ordered callback, replies on every socket may go out of order. Spare
+ * is callback state for a second batch, read from the same socket while
+ * the first one's recoveries are being done; it may be NULL. */
+typedef struct {
+    int epoll;
+    void *misc;
+    srv_ord *ordered;
+    void *spare;
+} srv_wrk_t;
+
+/* Serves requests on nwrks threads. The first worker runs on the calling
+ * thread and honors the idle timeout; another thread watches the key
+ * database, waiting until it has been quiet for quiet ms (but no more than
+ * SRV_QUIET_MAX times that) before applying a burst of changes. If evict is
+ * positive, that thread also unloads private keys left unused for evict
+ * seconds; they are read again when next needed.
+ *
+ * Advertisements and errors are answered as soon as a batch is read, and
+ * their replies are sent before any recovery in the same batch is done.
+ * Recoveries are shared out to ncrypto further threads, if any, with the
+ * worker doing its share. A worker with spare state instead keeps reading
+ * sockets whose replies may go out of order, answering what arrives, and
+ * helps with the recoveries in between.
+ *
+ * In a child of srv_prefork(), shm is where the keys come from: instead of
+ * watching dbdir, the other thread takes each snapshot the parent publishes.
+ * Otherwise, shm is NULL. */
+int
+srv_main(const char *dbdir, const srv_wrk_t *wrks, size_t nwrks,
+         srv_req *req, srv_rep *rep, int timeout, int quiet, int evict,
+         size_t ncrypto, shm_t *shm);
+
+/* Sets up the child of srv_prefork() in slot, then calls srv_main() with
+ * shm. */
+typedef int srv_child(shm_t *shm, size_t slot, void *misc);
+
+/* Serves requests from nprocs processes. This one reads the keys and signs
+ * the advertisement, then publishes them in memory shared with the children
+ * it forks, and again whenever the keys change (see srv_main() for quiet).
+ * Children that crash are replaced; if one fails otherwise, or on SIGTERM
+ * or SIGINT, they are all stopped. */
 int
-srv_main(const char *dbdir, int epoll, srv_req *req, srv_rep *rep,
-         void *misc, int timeout);
+srv_prefork(const char *dbdir, size_t nprocs, int quiet,
+            srv_child *child, void *misc);
@@ -16,6 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "idx.h"
+
 #include <openssl/ec.h>
 #include <openssl/objects.h>
 #include <openssl/pem.h>
@@ -185,17 +187,22 @@ main(int argc, char **argv)
     }
 
     if (PEM_write_ECPKParameters(file, grp) <= 0 ||
-        PEM_write_ECPrivateKey(file, key, NULL, NULL, 0, NULL, NULL) <= 0) {
+        PEM_write_ECPrivateKey(file, key, NULL, NULL, 0, NULL, NULL) <= 0 ||
+        fclose(file) != 0) {
         unlink(filename);
         error(EXIT_FAILURE, 0, "Error writing key");
     }
 
+    /* The key is usable without the index, so this is only a warning. */
+    r = idx_update(filename);
+    if (r != 0)
+        error(0, r, "Unable to update the key index");
+
     if (optind == argc)
         fprintf(stdout, "%s\n", basename(filename));
 
     EC_GROUP_free(grp);
     EC_KEY_free(key);
-    fclose(file);
     return 0;
 
 usage:
@@ -16,6 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "idx.h"
+
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <errno.h>
@@ -79,6 +81,10 @@ main(int argc, char **argv)
             error(EXIT_FAILURE, errno, "Unable to unadvertise");
     }
 
+    r = idx_update(filename);
+    if (r != 0)
+        error(0, r, "Unable to update the key index");
+
     return 0;
 
 usage:
@@ -16,12 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "ring.h"
 #include "srv.h"
 #include <limits.h>
 
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <error.h>
@@ -31,19 +33,9 @@
 #include <string.h>
 #include <unistd.h>
 
-#include <signal.h>
-
 #define _stringify(x) # x
 #define stringify(x) _stringify(x)
 
-static int s = -1;
-
-static void
-onsig(int sig)
-{
-    close(s);
-}
-
 static int
 parse(char *argx, const char **hostname, const char **port)
 {
@@ -86,45 +78,73 @@ parse(char *argx, const char **hostname, const char **port)
 }
 
 static int
-req(int sock, TANG_MSG **req, void *misc)
+req(int sock, pkt_t *pkts, size_t *npkts, void *misc)
 {
-    const unsigned char *position = NULL;
-    pkt_t *pkt = misc;
-    int r;
-
-    r = recv(sock, &pkt->data[pkt->size], sizeof(pkt->data) - pkt->size, 0);
-    if (r < 0) return errno;
-    if (r == 0) return 0;
-    pkt->size += r;
-
-    position = pkt->data;
-    *req = d2i_TANG_MSG(NULL, &position, pkt->size);
-    if (!*req)
-        return pkt->size == sizeof(pkt->data) ? EINVAL : EAGAIN;
-
-    pkt->size -= position - pkt->data;
-    memmove(pkt->data, position, pkt->size);
-    return 0;
+    pkt_t *buf = misc;
+    size_t max = *npkts;
+    ssize_t r;
+
+    /* Requests may be left over from a previous (full) batch. */
+    r = pkt_split(buf, pkts, npkts);
+    if (r != EAGAIN)
+        return r;
+
+    /* Grow the stream buffer a packet at a time; pkt_split() caps it. */
+    r = pkt_reserve(buf, buf->size + PKT_MTU > PKT_MAX
+                         ? PKT_MAX : buf->size + PKT_MTU);
+    if (r != 0)
+        return r;
+
+    r = recv(sock, &buf->data[buf->size], buf->cap - buf->size,
+             MSG_DONTWAIT);
+    if (r < 0) return errno == EWOULDBLOCK ? EAGAIN : errno;
+    if (r == 0) return *npkts = 0;
+    buf->size += r;
+
+    *npkts = max;
+    return pkt_split(buf, pkts, npkts);
 }
 
 static int
-rep(int sock, const pkt_t *pkt, void *misc)
+rep(int sock, const pkt_t *pkts, size_t npkts, void *misc)
 {
-    pkt_t out = *pkt;
-    ssize_t r = 0;
+    struct iovec iovs[npkts];
+    size_t n = 0;
+
+    for (size_t i = 0; i < npkts; i++) {
+        if (pkts[i].size > 0) {
+            iovs[n++] = (struct iovec) {
+                .iov_base = (void *) pkt_data(&pkts[i]),
+                .iov_len = pkts[i].size
+            };
+        }
+    }
 
-    while (out.size > 0) {
-        r = send(sock, out.data, out.size, 0);
+    /* Send the whole batch at once, resuming after short writes. */
+    for (struct iovec *iov = iovs; n > 0; ) {
+        ssize_t r = writev(sock, iov, n);
         if (r < 0)
             return errno;
 
-        memmove(out.data, &out.data[r], out.size - r);
-        out.size -= r;
+        for (; n > 0 && (size_t) r >= iov->iov_len; iov++, n--)
+            r -= iov->iov_len;
+
+        if (n > 0) {
+            iov->iov_base = (unsigned char *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
     }
 
     return 0;
 }
 
+/* There is only the one connection, so replies keep the requests' order. */
+static bool
+ordered(int sock, void *misc)
+{
+    return true;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -132,19 +152,23 @@ main(int argc, char *argv[])
     const char *host = NULL;
     const char *port = NULL;
     int timeout = 10000;
+    ring_t *ring = NULL;
+    bool uring = false;
     pkt_t pkt = {};
     int epoll = -1;
+    int s = -1;
     int r;
 
-    signal(SIGTERM, onsig);
-    signal(SIGINT, onsig);
-
-    for (int c; (c = getopt(argc, argv, "hd:t:")) != -1; ) {
+    for (int c; (c = getopt(argc, argv, "hd:t:u")) != -1; ) {
         switch (c) {
         case 'd':
             dbdir = optarg;
             break;
 
+        case 'u':
+            uring = true;
+            break;
+
         case 't':
             errno = 0;
             timeout = strtol(optarg, NULL, 10);
@@ -153,7 +177,7 @@ main(int argc, char *argv[])
 
         default:
             fprintf(stderr,
-                    "Usage: %s [-h] [-d DBDIR] [-t timeout] host[:port]\n",
+                    "Usage: %s [-h] [-u] [-d DBDIR] [-t timeout] host[:port]\n",
                     argv[0]);
             return EXIT_FAILURE;
         }
@@ -163,6 +187,21 @@ main(int argc, char *argv[])
     if (epoll < 0)
         error(EXIT_FAILURE, errno, "Error calling epoll_create()");
 
+    if (uring) {
+        r = ring_probe(true);
+        if (r != 0) {
+            fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+                    strerror(r));
+            uring = false;
+        }
+    }
+
+    if (uring) {
+        r = ring_init(true, &ring);
+        if (r != 0)
+            error(EXIT_FAILURE, r, "Error calling ring_init()");
+    }
+
     for (int i = optind; i < argc; i++) {
         r = parse(argv[i], &host, &port);
         if (r != 0)
@@ -190,13 +229,30 @@ main(int argc, char *argv[])
 
             r = connect(s, info->ai_addr, info->ai_addrlen);
             if (r == 0) {
-                if (epoll_ctl(epoll, EPOLL_CTL_ADD, s, &(struct epoll_event) {
+                int fd = s;
+
+                /* With a ring, the ring itself is what becomes readable. */
+                if (ring) {
+                    r = ring_add(ring, s);
+                    if (r != 0)
+                        error(EXIT_FAILURE, r, "Error calling ring_add()");
+                    fd = ring_fd(ring);
+                }
+
+                if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &(struct epoll_event) {
                     .events = EPOLLIN | EPOLLRDHUP | EPOLLPRI,
-                    .data.fd = s
+                    .data.fd = fd
                 }) != 0)
                     error(EXIT_FAILURE, errno, "Error calling epoll_ctl()");
 
-                if (srv_main(dbdir, epoll, req, rep, &pkt, timeout) != 0)
+                r = srv_main(dbdir, &(srv_wrk_t) {
+                                 .epoll = epoll,
+                                 .misc = ring ? (void *) ring : &pkt,
+                                 .ordered = ordered
+                             }, 1, ring ? ring_req : req,
+                             ring ? ring_rep : rep, timeout, SRV_QUIET, 0, 0,
+                             NULL);
+                if (r != 0)
                     error(EXIT_FAILURE, r, "Error during srv_main()");
                 close(s);
                 break;
@@ -210,6 +266,8 @@ main(int argc, char *argv[])
         freeaddrinfo(infos);
     }
 
+    ring_free(ring);
+    pkt_cleanup(&pkt);
     close(epoll);
     return s < 0;
 }
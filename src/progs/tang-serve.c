@@ -17,109 +17,950 @@
  */
 
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 
 #include <errno.h>
 #include <error.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "ring.h"
 #include "srv.h"
 
 #define LISTEN_FD_START 3
 
-struct addr {
-  struct sockaddr addr;
-  socklen_t size;
+#define TCP_CONNS 16384     /* Default most connections per worker. */
+#define TCP_IDLE 30         /* Default idle timeout, in seconds. */
+#define TCP_WHEEL 64        /* Slots in the idle timer wheel, one a second. */
+#define TCP_FDS (1 << 20)   /* Most fds, when there is no hard limit. */
+
+/* What the fds a process watches are. */
+enum kind {
+    KIND_DGRAM = 0,
+    KIND_LISTEN,        /* A stream socket accepting connections. */
+    KIND_TICK,          /* A worker's timer, turning its wheel. */
+};
+
+/* A stream connection. Requests that arrive in pieces, and replies the
+ * socket has no room for, wait in its buffers; idle ones have none. */
+struct conn {
+    struct conn *prev;  /* In its slot of the wheel. */
+    struct conn *next;
+    uint64_t last;      /* The tick it was last used in. */
+    size_t slot;
+    pkt_t in;
+    unsigned char *out;
+    size_t outlen;
+    size_t outoff;
+    size_t outcap;
+    bool dead;          /* Failed to send; closed when next woken. */
+    int fd;
+};
+
+/* Shared by the workers of a process, and indexed by fd. The kinds are set
+ * before the workers start; each connection belongs to the worker that
+ * accepted it, which alone uses or frees it. */
+struct table {
+    unsigned char *kinds;
+    struct conn **conns;
+    struct batch **owners;
+    size_t size;
+};
+
+/* Per-worker batch state: one peer address per datagram. Datagrams larger
+ * than their buffer go on into spill, which has PKT_MAX bytes for each, and
+ * are then moved into the grown buffer. Connections are read through buf
+ * and time out on the wheel: each is found again in the slot where its
+ * timeout would fall, and closed if it was idle since. */
+struct batch {
+    struct sockaddr_storage addrs[SRV_BATCH];
+    socklen_t lens[SRV_BATCH];
+    struct mmsghdr msgs[SRV_BATCH];
+    struct iovec iovs[SRV_BATCH * 2];
+    unsigned char *spill;
+
+    struct table *tab;
+    int epoll;
+    pkt_t buf;
+    struct conn *wheel[TCP_WHEEL];
+    uint64_t now;       /* Ticks so far. */
+    size_t nconns;
+    size_t maxconns;
+    int idle;           /* In ticks, or zero for no timeout. */
 };
 
-static int fds;
+/* Finds the worker's connection on fd, if any. An event that was waiting
+ * while its connection was closed may name an fd that another worker has
+ * since accepted: that fd is foreign, and must be left alone. An fd can
+ * only be reused once its owner has closed it, so checking the owner is
+ * enough; a stale event for a connection of our own is just spurious. */
+static struct conn *
+conn_get(const struct batch *bat, int fd, bool *foreign)
+{
+    const struct batch *owner;
+
+    *foreign = false;
+    if (fd < 0 || (size_t) fd >= bat->tab->size)
+        return NULL;
+
+    owner = __atomic_load_n(&bat->tab->owners[fd], __ATOMIC_ACQUIRE);
+    if (!owner)
+        return NULL;
+
+    *foreign = owner != bat;
+    return *foreign ? NULL : bat->tab->conns[fd];
+}
+
+static void
+conn_link(struct batch *bat, struct conn *c, size_t slot)
+{
+    c->slot = slot;
+    c->prev = NULL;
+    c->next = bat->wheel[slot];
+    if (c->next)
+        c->next->prev = c;
+    bat->wheel[slot] = c;
+}
+
+static void
+conn_unlink(struct batch *bat, struct conn *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        bat->wheel[c->slot] = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+}
+
+static void
+conn_close(struct batch *bat, struct conn *c)
+{
+    conn_unlink(bat, c);
+    bat->tab->conns[c->fd] = NULL;
+    __atomic_store_n(&bat->tab->owners[c->fd], NULL, __ATOMIC_RELEASE);
+    close(c->fd);
+    pkt_cleanup(&c->in);
+    free(c->out);
+    free(c);
+    bat->nconns--;
+}
+
+/* Waits for the connection to take more replies, or for more requests. */
+static int
+conn_arm(struct batch *bat, struct conn *c, bool out)
+{
+    if (epoll_ctl(bat->epoll, EPOLL_CTL_MOD, c->fd, &(struct epoll_event) {
+        .events = out ? EPOLLOUT : EPOLLIN | EPOLLRDHUP,
+        .data.fd = c->fd
+    }) != 0)
+        return errno;
+
+    return 0;
+}
+
+/* Sends the replies the socket had no room for before. Returns EAGAIN if
+ * some are still left. */
+static int
+conn_flush(struct conn *c)
+{
+    while (c->outoff < c->outlen) {
+        ssize_t r = send(c->fd, &c->out[c->outoff], c->outlen - c->outoff,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0)
+            return errno == EWOULDBLOCK ? EAGAIN : errno;
+
+        c->outoff += r;
+    }
+
+    /* An idle connection keeps no buffers. */
+    free(c->out);
+    c->out = NULL;
+    c->outlen = c->outoff = c->outcap = 0;
+    return 0;
+}
 
+/* Accepts the connections waiting on a listening socket. Those beyond the
+ * worker's limit are closed at once, so clients fail fast and try again. */
 static void
-onsig(int sig)
+conn_accept(struct batch *bat, int sock)
+{
+    for (size_t i = 0; i < SRV_BATCH; i++) {
+        struct conn *c = NULL;
+        int fd;
+
+        fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            /* Out of fds or memory: leave the rest for later. */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        if (bat->nconns < bat->maxconns && (size_t) fd < bat->tab->size)
+            c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->last = bat->now;
+        if (epoll_ctl(bat->epoll, EPOLL_CTL_ADD, fd, &(struct epoll_event) {
+            .events = EPOLLIN | EPOLLRDHUP,
+            .data.fd = fd
+        }) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        conn_link(bat, c, (bat->now + bat->idle) % TCP_WHEEL);
+        bat->tab->conns[fd] = c;
+        __atomic_store_n(&bat->tab->owners[fd], bat, __ATOMIC_RELEASE);
+        bat->nconns++;
+    }
+}
+
+/* Turns the wheel once per tick that has passed. Connections used since
+ * they were linked are moved to the slot where their timeout now falls. */
+static void
+conn_tick(struct batch *bat, int fd)
+{
+    uint64_t ticks = 0;
+
+    if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+
+    while (ticks-- > 0) {
+        size_t slot = ++bat->now % TCP_WHEEL;
+        struct conn *next = NULL;
+
+        for (struct conn *c = bat->wheel[slot]; c; c = next) {
+            size_t due = (c->last + bat->idle) % TCP_WHEEL;
+
+            next = c->next;
+            if (bat->now - c->last >= (uint64_t) bat->idle) {
+                conn_close(bat, c);
+            } else if (due != slot) {
+                conn_unlink(bat, c);
+                conn_link(bat, c, due);
+            }
+        }
+    }
+}
+
+/* Reads the requests a connection has sent. They may be pipelined, and
+ * arrive in any pieces: whole ones are returned and the rest is kept for
+ * next time. Pending replies go out first, and nothing more is read until
+ * they have, so that a client that doesn't read can't make us buffer
+ * without end. Connections are closed here, and never reported as gone:
+ * that would end the worker. */
+static int
+conn_req(struct batch *bat, struct conn *c, pkt_t *pkts, size_t *npkts)
 {
-    for (int i = 0; i < fds; i++)
-        close(i + LISTEN_FD_START);
+    pkt_t *buf = &bat->buf;
+    size_t max = *npkts;
+    ssize_t n;
+    int r;
+
+    if (c->dead)
+        goto close;
+
+    if (c->outoff < c->outlen) {
+        r = conn_flush(c);
+        if (r == EAGAIN)
+            return EAGAIN;
+        if (r != 0 || conn_arm(bat, c, false) != 0)
+            goto close;
+    }
+
+    c->last = bat->now;
+
+    /* Whole requests may be left over from a previous (full) batch. */
+    buf->size = c->in.size;
+    if (c->in.size > 0)
+        memcpy(buf->data, c->in.data, c->in.size);
+    c->in.size = 0;
+
+    r = pkt_split(buf, pkts, npkts);
+    if (r == EAGAIN) {
+        n = recv(c->fd, &buf->data[buf->size], buf->cap - buf->size,
+                 MSG_DONTWAIT);
+        if (n == 0)
+            goto close;
+        if (n < 0) {
+            if (errno != EWOULDBLOCK)
+                goto close;
+        } else {
+            buf->size += n;
+            *npkts = max;
+            r = pkt_split(buf, pkts, npkts);
+        }
+    }
+
+    /* Something that isn't a request can't be skipped, so give up. */
+    if (r != 0 && r != EAGAIN)
+        goto close;
+
+    if (buf->size == 0) {
+        pkt_cleanup(&c->in);
+    } else {
+        if (pkt_reserve(&c->in, buf->size) != 0)
+            goto close;
+
+        memcpy(c->in.data, buf->data, buf->size);
+        c->in.size = buf->size;
+    }
+
+    return r;
+
+close:
+    conn_close(bat, c);
+    return EAGAIN;
+}
+
+/* Sends replies in one call if the socket has room, and keeps what it
+ * hasn't. A connection that fails is closed when next woken, which it will
+ * be, as it has an error pending. */
+static int
+conn_rep(struct batch *bat, struct conn *c, const pkt_t *pkts, size_t npkts)
+{
+    struct iovec iovs[npkts];
+    size_t len = 0;
+    ssize_t r = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < npkts; i++) {
+        if (pkts[i].size > 0) {
+            iovs[n++] = (struct iovec) {
+                .iov_base = (void *) pkt_data(&pkts[i]),
+                .iov_len = pkts[i].size
+            };
+            len += pkts[i].size;
+        }
+    }
+
+    if (c->dead || n == 0)
+        return 0;
+
+    /* Replies must not overtake those already waiting. */
+    if (c->outoff == c->outlen) {
+        r = sendmsg(c->fd, &(struct msghdr) { .msg_iov = iovs,
+                                              .msg_iovlen = n },
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0 && errno != EWOULDBLOCK) {
+            c->dead = true;
+            return 0;
+        }
+        if (r < 0)
+            r = 0;
+        if ((size_t) r == len)
+            return 0;
+    }
+
+    if (c->outlen + len - r > c->outcap) {
+        size_t cap = c->outcap > 0 ? c->outcap : PKT_MTU;
+        unsigned char *out = NULL;
+
+        while (cap < c->outlen + len - r)
+            cap *= 2;
+
+        out = realloc(c->out, cap);
+        if (!out) {
+            c->dead = true;
+            return 0;
+        }
+
+        c->out = out;
+        c->outcap = cap;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        size_t skip = (size_t) r < iovs[i].iov_len ? (size_t) r
+                                                   : iovs[i].iov_len;
+
+        memcpy(&c->out[c->outlen], (unsigned char *) iovs[i].iov_base + skip,
+               iovs[i].iov_len - skip);
+        c->outlen += iovs[i].iov_len - skip;
+        r -= skip;
+    }
+
+    if (conn_arm(bat, c, true) != 0)
+        c->dead = true;
+
+    return 0;
 }
 
 static int
-req(int sock, TANG_MSG **req, void *misc)
+req(int sock, pkt_t *pkts, size_t *npkts, void *misc)
 {
-    struct addr *addr = misc;
-    pkt_t pkt = {};
+    struct batch *bat = misc;
+    bool foreign = false;
+    struct conn *c = conn_get(bat, sock, &foreign);
+    int r;
+
+    if (foreign)
+        return EAGAIN;
 
-    pkt.size = recvfrom(sock, pkt.data, sizeof(pkt.data), 0,
-                        &addr->addr, &addr->size);
-    if (pkt.size < 0)
+    if (c)
+        return conn_req(bat, c, pkts, npkts);
+
+    switch (bat->tab->kinds[sock]) {
+    case KIND_LISTEN:
+        conn_accept(bat, sock);
+        return EAGAIN;
+
+    case KIND_TICK:
+        conn_tick(bat, sock);
         return EAGAIN;
+    }
+
+    for (size_t i = 0; i < *npkts; i++) {
+        bat->iovs[i * 2] = (struct iovec) {
+            .iov_base = pkts[i].data,
+            .iov_len = pkts[i].cap
+        };
+
+        bat->iovs[i * 2 + 1] = (struct iovec) {
+            .iov_base = &bat->spill[i * PKT_MAX],
+            .iov_len = PKT_MAX - pkts[i].cap
+        };
+
+        bat->msgs[i].msg_hdr = (struct msghdr) {
+            .msg_name = &bat->addrs[i],
+            .msg_namelen = sizeof(bat->addrs[i]),
+            .msg_iov = &bat->iovs[i * 2],
+            .msg_iovlen = 2,
+        };
+    }
+
+    /* Don't block: with shared sockets another worker may win the race. */
+    r = recvmmsg(sock, bat->msgs, *npkts, MSG_DONTWAIT, NULL);
+    if (r <= 0)
+        return EAGAIN;
+
+    /* Requests larger than PKT_MAX are dropped unanswered. */
+    for (int i = 0; i < r; i++) {
+        size_t len = bat->msgs[i].msg_len;
+        size_t cap = pkts[i].cap;
+
+        bat->lens[i] = bat->msgs[i].msg_hdr.msg_namelen;
+        pkts[i].size = 0;
+
+        if (bat->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            continue;
+
+        if (len > cap) {
+            if (pkt_reserve(&pkts[i], len) != 0)
+                continue;
+
+            memcpy(&pkts[i].data[cap], &bat->spill[i * PKT_MAX], len - cap);
+        }
+
+        pkts[i].size = len;
+    }
+
+    *npkts = r;
+    return 0;
+}
+
+static int
+rep(int sock, const pkt_t *pkts, size_t npkts, void *misc)
+{
+    struct batch *bat = misc;
+    bool foreign = false;
+    struct conn *c = conn_get(bat, sock, &foreign);
+    size_t n = 0;
+
+    if (foreign)
+        return 0;
+
+    if (c)
+        return conn_rep(bat, c, pkts, npkts);
+
+    /* Reuse the receive headers for sending. A batch may be answered in
+     * several calls, so the peer addresses are kept apart. */
+    for (size_t i = 0; i < npkts; i++) {
+        if (pkts[i].size <= 0)
+            continue;
+
+        bat->iovs[n] = (struct iovec) {
+            .iov_base = (void *) pkt_data(&pkts[i]),
+            .iov_len = pkts[i].size
+        };
+
+        bat->msgs[n].msg_hdr = (struct msghdr) {
+            .msg_name = &bat->addrs[i],
+            .msg_namelen = bat->lens[i],
+            .msg_iov = &bat->iovs[n],
+            .msg_iovlen = 1,
+        };
+
+        n++;
+    }
+
+    /* Datagrams that fail to send are dropped, just like lost ones. */
+    for (size_t i = 0; i < n; ) {
+        int r = sendmmsg(sock, &bat->msgs[i], n - i, 0);
+        i += r > 0 ? (size_t) r : 1;
+    }
+
+    return 0;
+}
+
+/* Replies on a connection must keep the order of the requests; datagrams
+ * are answered as soon as they can be. */
+static bool
+ordered(int sock, void *misc)
+{
+    bool foreign = false;
+
+    return conn_get(misc, sock, &foreign) || foreign;
+}
+
+/* Opens another socket bound to the same address as fd using SO_REUSEPORT,
+ * so that the kernel spreads incoming datagrams across workers. This only
+ * works if fd was itself created with SO_REUSEPORT (see ReusePort=). */
+static int
+shard(int fd)
+{
+    struct sockaddr_storage addr = {};
+    socklen_t size = sizeof(addr);
+    socklen_t len = sizeof(int);
+    int type = 0;
+    int on = 0;
+    int s = -1;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, &len) != 0 || !on)
+        return -1;
+
+    len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0)
+        return -1;
+
+    if (getsockname(fd, (struct sockaddr *) &addr, &size) != 0)
+        return -1;
+
+    if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+        return -1;
+
+    s = socket(addr.ss_family, type | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+        goto error;
+
+    if (addr.ss_family == AF_INET6) {
+        len = sizeof(on);
+        if (getsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, &len) != 0 ||
+            setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0)
+            goto error;
+    }
+
+    if (bind(s, (struct sockaddr *) &addr, size) != 0)
+        goto error;
+
+    if (type == SOCK_STREAM && listen(s, SOMAXCONN) != 0)
+        goto error;
+
+    return s;
+
+error:
+    close(s);
+    return -1;
+}
+
+static void
+watch(const srv_wrk_t *wrk, ring_t *ring, int fd, bool exclusive)
+{
+    int r;
+
+    /* A ring keeps its own receive posted on each socket. */
+    if (ring) {
+        r = ring_add(ring, fd);
+        if (r != 0)
+            error(EXIT_FAILURE, r, "Error calling ring_add()");
+        return;
+    }
+
+    /* EPOLLEXCLUSIVE may not be combined with EPOLLRDHUP or EPOLLPRI. */
+    if (epoll_ctl(wrk->epoll, EPOLL_CTL_ADD, fd, &(struct epoll_event) {
+        .events = exclusive ? EPOLLIN | EPOLLEXCLUSIVE
+                            : EPOLLIN | EPOLLRDHUP | EPOLLPRI,
+        .data.fd = fd
+    }) != 0)
+        error(EXIT_FAILURE, errno, "Error calling epoll_ctl()");
+}
+
+/* How to serve, from the command line and the environment. */
+struct opts {
+    const char *dbdir;
+    long nprocs;
+    long nwrks;
+    long ncrypto;       /* Or -1 for the CPUs the workers leave over. */
+    long maxconns;      /* Per worker. */
+    int quiet;
+    int evict;
+    int idle;
+    int fds;
+    bool streams;       /* Whether any of the sockets accepts connections. */
+    bool uring;
+};
+
+/* Whether fd is a stream socket accepting connections (ListenStream=). */
+static bool
+listening(int fd)
+{
+    socklen_t len = sizeof(int);
+    int on = 0;
+
+    return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 && on;
+}
+
+/* Returns how many fds the process may have, first raising the limit as
+ * far as allowed if it will accept connections. */
+static size_t
+max_fds(bool streams)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 1024;
+
+    if (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > TCP_FDS)
+        rl.rlim_max = TCP_FDS;
+
+    if (streams && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    return rl.rlim_cur > TCP_FDS ? TCP_FDS : rl.rlim_cur;
+}
+
+/* Records what fd is. Listening sockets are made nonblocking, as another
+ * worker may accept the connection that woke this one. */
+static void
+set_kind(struct table *tab, int fd, enum kind kind)
+{
+    int flags;
 
-    *req = d2i_TANG_MSG(NULL, &(const uint8_t *) { pkt.data }, pkt.size);
-    return *req ? 0 : EAGAIN;
+    if (fd < 0 || (size_t) fd >= tab->size)
+        error(EXIT_FAILURE, EMFILE, "Error watching socket");
+
+    tab->kinds[fd] = kind;
+    if (kind != KIND_LISTEN)
+        return;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+        error(EXIT_FAILURE, errno, "Error calling fcntl()");
 }
 
+/* Sets up the workers of one process and serves with them. In prefork mode,
+ * this runs in each child, which shares the listening sockets with the
+ * others. */
 static int
-rep(int sock, const pkt_t *pkt, void *misc)
+serve(shm_t *shm, size_t slot, void *misc)
 {
-    struct addr *addr = misc;
-    sendto(sock, pkt->data, pkt->size, 0, &addr->addr, addr->size);
+    const struct opts *opts = misc;
+    long nwrks = opts->nwrks;
+    long ncrypto = opts->ncrypto;
+    struct table tab = {};
+    srv_wrk_t *wrks = NULL;
+    struct batch *bats = NULL;
+    struct batch *spares = NULL;
+    ring_t **rings = NULL;
+    bool alone = nwrks == 1 && opts->nprocs <= 1;
+    size_t maxconns = opts->maxconns;
+    int r;
+
+    /* Keep some fds back, so that accepting never runs out of them. */
+    tab.size = max_fds(opts->streams);
+    if (tab.size < (size_t) opts->fds * nwrks + 64)
+        tab.size = opts->fds * nwrks + 64;
+    if (maxconns > (tab.size - 64) / nwrks)
+        maxconns = (tab.size - 64) / nwrks;
+
+    /* By default, recoveries get a thread for each CPU of this process's
+     * share that the workers leave over, up to one per worker. */
+    if (ncrypto < 0) {
+        ncrypto = sysconf(_SC_NPROCESSORS_ONLN);
+        if (opts->nprocs > 1)
+            ncrypto /= opts->nprocs;
+
+        ncrypto -= nwrks;
+        if (ncrypto < 0)
+            ncrypto = 0;
+        else if (ncrypto > nwrks)
+            ncrypto = nwrks;
+    }
+
+    tab.kinds = calloc(tab.size, sizeof(*tab.kinds));
+    tab.conns = calloc(tab.size, sizeof(*tab.conns));
+    tab.owners = calloc(tab.size, sizeof(*tab.owners));
+    wrks = calloc(nwrks, sizeof(*wrks));
+    bats = calloc(nwrks, sizeof(*bats));
+    spares = calloc(nwrks, sizeof(*spares));
+    rings = calloc(nwrks, sizeof(*rings));
+    if (!tab.kinds || !tab.conns || !tab.owners || !wrks || !bats ||
+        !spares || !rings)
+        error(EXIT_FAILURE, ENOMEM, "Error allocating workers");
+
+    for (long i = 0; i < nwrks; i++) {
+        bats[i].tab = &tab;
+        bats[i].maxconns = maxconns;
+        bats[i].idle = opts->idle;
+
+        wrks[i].ordered = opts->streams ? ordered : NULL;
+        wrks[i].misc = &bats[i];
+        wrks[i].epoll = epoll_create(1024);
+        if (wrks[i].epoll < 0)
+            error(EXIT_FAILURE, errno, "Error calling epoll_create()");
+        bats[i].epoll = wrks[i].epoll;
+
+        if (opts->streams) {
+            r = pkt_reserve(&bats[i].buf, PKT_MAX);
+            if (r != 0)
+                error(EXIT_FAILURE, r, "Error allocating workers");
+        }
+
+        /* Only the pages large datagrams reach are ever used. The spare
+         * batch reads datagrams while recoveries are being done. */
+        if (!opts->uring) {
+            bats[i].spill = malloc(SRV_BATCH * PKT_MAX);
+            if (!bats[i].spill)
+                error(EXIT_FAILURE, ENOMEM, "Error allocating workers");
+        }
+
+        if (!opts->uring && ncrypto > 0) {
+            spares[i].tab = &tab;
+            spares[i].spill = malloc(SRV_BATCH * PKT_MAX);
+            if (!spares[i].spill)
+                error(EXIT_FAILURE, ENOMEM, "Error allocating workers");
+
+            wrks[i].spare = &spares[i];
+        }
+
+        if (opts->streams && opts->idle > 0) {
+            struct itimerspec its = {
+                .it_interval.tv_sec = 1,
+                .it_value.tv_sec = 1,
+            };
+            int fd;
+
+            fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (fd < 0 || timerfd_settime(fd, 0, &its, NULL) != 0)
+                error(EXIT_FAILURE, errno, "Error creating timer");
+
+            set_kind(&tab, fd, KIND_TICK);
+            watch(&wrks[i], NULL, fd, false);
+        }
+
+        if (!opts->uring)
+            continue;
+
+        r = ring_init(false, &rings[i]);
+        if (r != 0)
+            error(EXIT_FAILURE, r, "Error calling ring_init()");
+
+        wrks[i].misc = rings[i];
+        if (epoll_ctl(wrks[i].epoll, EPOLL_CTL_ADD, ring_fd(rings[i]),
+                      &(struct epoll_event) {
+                          .events = EPOLLIN,
+                          .data.fd = ring_fd(rings[i])
+                      }) != 0)
+            error(EXIT_FAILURE, errno, "Error calling epoll_ctl()");
+    }
+
+    for (int i = 0; i < opts->fds; i++) {
+        int fd = i + LISTEN_FD_START;
+        enum kind kind = listening(fd) ? KIND_LISTEN : KIND_DGRAM;
+        int shards[nwrks];
+        long j;
+
+        /* Prefer one SO_REUSEPORT socket per worker. The socket itself goes
+         * to the first worker of the first process. */
+        for (j = 0; j < nwrks; j++) {
+            shards[j] = j == 0 && slot == 0 ? fd : shard(fd);
+            if (shards[j] < 0)
+                break;
+        }
+
+        if (j == nwrks) {
+            for (j = 0; j < nwrks; j++) {
+                set_kind(&tab, shards[j], kind);
+                watch(&wrks[j], rings[j], shards[j], false);
+            }
+            continue;
+        }
+
+        /* Otherwise, share the socket but wake only one worker per packet. */
+        while (--j >= 0) {
+            if (shards[j] != fd)
+                close(shards[j]);
+        }
+
+        set_kind(&tab, fd, kind);
+        for (j = 0; j < nwrks; j++)
+            watch(&wrks[j], rings[j], fd, !alone);
+    }
+
+    if (opts->uring)
+        r = srv_main(opts->dbdir, wrks, nwrks, ring_req, ring_rep, -1,
+                     opts->quiet, opts->evict, ncrypto, shm);
+    else
+        r = srv_main(opts->dbdir, wrks, nwrks, req, rep, -1, opts->quiet,
+                     opts->evict, ncrypto, shm);
+    if (r != 0)
+        error(EXIT_FAILURE, r, "Error calling srv_main()");
+
+    for (long i = 0; i < nwrks; i++) {
+        for (size_t s = 0; s < TCP_WHEEL; s++) {
+            while (bats[i].wheel[s])
+                conn_close(&bats[i], bats[i].wheel[s]);
+        }
+
+        pkt_cleanup(&bats[i].buf);
+        free(bats[i].spill);
+        free(spares[i].spill);
+        close(wrks[i].epoll);
+        ring_free(rings[i]);
+    }
+
+    free(tab.kinds);
+    free(tab.conns);
+    free(tab.owners);
+    free(rings);
+    free(spares);
+    free(bats);
+    free(wrks);
     return 0;
 }
 
 int
 main(int argc, char *argv[])
 {
-    const char *dbdir = TANG_DB;
+    struct opts opts = {
+        .dbdir = TANG_DB, .nwrks = 1, .ncrypto = -1, .quiet = SRV_QUIET,
+        .maxconns = TCP_CONNS, .idle = TCP_IDLE
+    };
     const char *lfds = NULL;
-    struct addr addr = {};
-    int epoll;
     int r;
 
-    for (int c; (c = getopt(argc, argv, "hd:")) != -1; ) {
+    for (int c; (c = getopt(argc, argv, "hc:d:e:k:m:p:q:uw:")) != -1; ) {
         switch (c) {
+        case 'c':
+            errno = 0;
+            opts.ncrypto = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.ncrypto >= 0)
+                break;
+            goto usage;
+
         case 'd':
-            dbdir = optarg;
+            opts.dbdir = optarg;
             break;
 
+        case 'e':
+            errno = 0;
+            opts.evict = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.evict >= 0)
+                break;
+            goto usage;
+
+        case 'k':
+            errno = 0;
+            opts.idle = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.idle >= 0)
+                break;
+            goto usage;
+
+        case 'm':
+            errno = 0;
+            opts.maxconns = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.maxconns > 0)
+                break;
+            goto usage;
+
+        case 'p':
+            errno = 0;
+            opts.nprocs = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.nprocs >= 0)
+                break;
+            goto usage;
+
+        case 'q':
+            errno = 0;
+            opts.quiet = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.quiet >= 0)
+                break;
+            goto usage;
+
+        case 'u':
+            opts.uring = true;
+            break;
+
+        case 'w':
+            errno = 0;
+            opts.nwrks = strtol(optarg, NULL, 10);
+            if (errno == 0 && opts.nwrks > 0)
+                break;
+            goto usage;
+
         default:
-            fprintf(stderr, "Usage: %s [-h] [-d DBDIR]\n", argv[0]);
+        usage:
+            fprintf(stderr, "Usage: %s [-h] [-u] [-c THREADS] [-d DBDIR] "
+                    "[-e SECONDS] [-k SECONDS] [-m CONNS] [-p PROCS] "
+                    "[-q MSEC] [-w WORKERS]\n", argv[0]);
             return EXIT_FAILURE;
         }
     }
 
-    epoll = epoll_create(1024);
-    if (epoll < 0)
-        error(EXIT_FAILURE, errno, "Error calling epoll_create()");
-
     /* Setup listening sockets. */
     lfds = getenv("LISTEN_FDS");
     if (!lfds)
         error(EXIT_FAILURE, 0, "No listening sockets");
 
     errno = 0;
-    fds = strtol(lfds, NULL, 10);
-    if (errno != 0 || fds == 0)
+    opts.fds = strtol(lfds, NULL, 10);
+    if (errno != 0 || opts.fds == 0)
         error(EXIT_FAILURE, errno, "Invalid LISTEN_FDS: %s", lfds);
 
-    for (int i = 0; i < fds; i++) {
-        int fd = i + LISTEN_FD_START;
+    for (int i = 0; i < opts.fds; i++)
+        opts.streams |= listening(i + LISTEN_FD_START);
 
-        if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &(struct epoll_event) {
-            .events = EPOLLIN | EPOLLRDHUP | EPOLLPRI,
-            .data.fd = fd
-        }) != 0)
-            error(EXIT_FAILURE, errno, "Error calling epoll_ctl()");
+    if (opts.uring && opts.streams) {
+        fprintf(stderr, "io_uring does not accept connections, using epoll\n");
+        opts.uring = false;
     }
 
-    signal(SIGTERM, onsig);
-    signal(SIGINT, onsig);
+    if (opts.uring) {
+        r = ring_probe(false);
+        if (r != 0) {
+            fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+                    strerror(r));
+            opts.uring = false;
+        }
+    }
+
+    if (opts.nprocs == 0)
+        return serve(NULL, 0, &opts);
 
-    r = srv_main(dbdir, epoll, req, rep, &addr, -1);
+    r = srv_prefork(opts.dbdir, opts.nprocs, opts.quiet, serve, &opts);
     if (r != 0)
-        error(EXIT_FAILURE, r, "Error calling srv_main()");
+        error(EXIT_FAILURE, r, "Error calling srv_prefork()");
 
-    close(epoll);
     return 0;
 }
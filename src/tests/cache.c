@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../progs/adv.h"
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+static void
+test(bool cond, const char *str, const char *file, int line)
+{
+    if (cond)
+      return;
+
+    error(EXIT_FAILURE, 0, "FAILURE: %s:%d:\n%s", file, line, str);
+}
+
+#define _str(x) # x
+#define test(x) test((x), _str(x), __FILE__, __LINE__)
+
+const char *
+keys_init(void);
+
+void
+keys_run(const char *prog, const char *args, const char *name);
+
+static const char *tempdir;
+
+/* Builds an advertisement from scratch, saves any signatures it made, and
+ * returns its full reply. */
+static void
+advertise(const db_t *db, pkt_t *pkt)
+{
+    adv_t *adv = NULL;
+
+    test(adv_init(&adv) == 0);
+    test(adv_update(adv, db) == 0);
+    adv_cache(adv, db);
+    test(adv_sign(adv, &(pkt_adv_t) {}, pkt) == TANG_MSG_ERR_NONE);
+    adv_free(adv);
+}
+
+/* Unloads every private key and returns how many were loaded. */
+static size_t
+unload(const db_t *db)
+{
+    EC_KEY *dead[8];
+    size_t n;
+
+    n = db_evict(db, 0, dead, sizeof(dead) / sizeof(*dead));
+    for (size_t i = 0; i < n; i++)
+        EC_KEY_free(dead[i]);
+
+    return n;
+}
+
+static bool
+same(const pkt_t *a, const pkt_t *b)
+{
+    return a->size == b->size &&
+           memcmp(pkt_data(a), pkt_data(b), a->size) == 0;
+}
+
+/* Checks that repeated requests are answered from the reply cache, and that
+ * requests for new filters can't push out the ones in use. */
+static void
+replies(const db_t *db)
+{
+    unsigned char pub[97] = { POINT_CONVERSION_UNCOMPRESSED };
+    adv_t *adv = NULL;
+    void *dead[64];
+    pkt_t a = {};
+    pkt_t b = {};
+    size_t total = 0;
+    size_t n = 0;
+
+    test(adv_init(&adv) == 0);
+    test(adv_update(adv, db) == 0);
+
+    /* The first reply is made, the next merely views the cached one. */
+    test(adv_sign(adv, &(pkt_adv_t) {}, &a) == TANG_MSG_ERR_NONE);
+    test(!a.view);
+    test(adv_sign(adv, &(pkt_adv_t) {}, &b) == TANG_MSG_ERR_NONE);
+    test(b.view && same(&a, &b));
+
+    for (int i = 0; i < 1000; i++) {
+        const unsigned char *view = b.view;
+        pkt_adv_t req = {
+            .key = true, .grp = NID_secp384r1,
+            .pub = pub, .publen = sizeof(pub)
+        };
+
+        /* Keys we don't have are never cached... */
+        memcpy(&pub[1], &i, sizeof(i));
+        test(adv_sign(adv, &req, &a) == TANG_MSG_ERR_NOTFOUND_KEY);
+
+        /* ...but filters that match nothing are, in place of others. */
+        req = (pkt_adv_t) { .grps = { .restricted = true, .n = 1 } };
+        req.grps.nids[0] = NID_undef - 1 - i;
+        test(adv_sign(adv, &req, &a) == TANG_MSG_ERR_NOTFOUND_KEY);
+
+        test(adv_sign(adv, &(pkt_adv_t) {}, &b) == TANG_MSG_ERR_NONE);
+        test(b.view == view);
+    }
+
+    /* What was replaced is kept until it is handed over, but not forever. */
+    while ((n = adv_retired(adv, dead, sizeof(dead) / sizeof(*dead))) > 0) {
+        for (size_t i = 0; i < n; i++)
+            free(dead[i]);
+        total += n;
+    }
+    test(total > 0 && total < 1000);
+
+    pkt_cleanup(&a);
+    pkt_cleanup(&b);
+    adv_free(adv);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char other[PATH_MAX];
+    char path[PATH_MAX];
+    adv_t *adv = NULL;
+    pkt_t a = {};
+    pkt_t b = {};
+    db_t *db = NULL;
+    FILE *f = NULL;
+    int c;
+
+    OpenSSL_add_all_algorithms();
+
+    tempdir = keys_init();
+
+    keys_run("tang-gen", "-A secp384r1 sig", "sig384");
+    keys_run("tang-gen", "-A secp521r1 sig", "sig521");
+    keys_run("tang-gen", "-A secp384r1 rec", "rec384");
+
+    /* Files that aren't keys are skipped rather than fatal. */
+    test(snprintf(path, sizeof(path), "%s/junk", tempdir) > 0);
+    test(f = fopen(path, "w"));
+    test(fputs("junk\n", f) != EOF);
+    test(fclose(f) == 0);
+
+    test(db_open(tempdir, &db) == 0);
+    test(db->nkeys == 3);
+    test(unload(db) == 0);
+
+    test(snprintf(path, sizeof(path), "%s/.tang-sigs", tempdir) > 0);
+
+    /* Updating alone leaves saving to the caller. */
+    test(adv_init(&adv) == 0);
+    test(adv_update(adv, db) == 0);
+    test(access(path, F_OK) != 0);
+    adv_free(adv);
+    adv = NULL;
+
+    /* ECDSA signatures are randomized, so equal replies mean reuse. */
+    advertise(db, &a);
+    test(access(path, R_OK) == 0);
+    advertise(db, &b);
+    test(same(&a, &b));
+
+    /* Private keys are only read to sign, and read again after eviction. */
+    test(unload(db) == 2);
+    advertise(db, &b);
+    test(same(&a, &b));
+    test(unload(db) == 0);
+
+    /* Without the cache, everything is signed afresh. */
+    test(unlink(path) == 0);
+    advertise(db, &b);
+    test(!same(&a, &b));
+    advertise(db, &a);
+    test(same(&a, &b));
+
+    /* A damaged cache is ignored, then replaced. */
+    test(f = fopen(path, "r+"));
+    test(fseek(f, -1, SEEK_END) == 0);
+    test((c = fgetc(f)) != EOF);
+    test(fseek(f, -1, SEEK_END) == 0);
+    test(fputc(~c, f) != EOF);
+    test(fclose(f) == 0);
+    advertise(db, &b);
+    test(!same(&a, &b));
+    advertise(db, &a);
+    test(same(&a, &b));
+
+    replies(db);
+
+    /* A key that no longer matches its file fails the update, which frees
+     * whatever the other keys got signed. */
+    test(unlink(path) == 0);
+    test(unload(db) == 2);
+    keys_run("tang-gen", "-A secp521r1 sig", "other");
+    test(snprintf(path, sizeof(path), "%s/other", tempdir) > 0);
+    test(snprintf(other, sizeof(other), "%s/sig521", tempdir) > 0);
+    test(rename(path, other) == 0);
+    test(adv_init(&adv) == 0);
+    test(adv_update(adv, db) != 0);
+    adv_free(adv);
+
+    pkt_cleanup(&a);
+    pkt_cleanup(&b);
+    db_free(db);
+    EVP_cleanup();
+    return 0;
+}
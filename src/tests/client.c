@@ -19,6 +19,7 @@
 #include "../asn1.h"
 #include "../conv.h"
 #include "../pkt.h"
+#include "../progs/srv.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -26,6 +27,7 @@
 #include <errno.h>
 #include <error.h>
 #include <limits.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <openssl/pem.h>
@@ -51,8 +53,10 @@ request(int sock, const TANG_MSG *req, const char *file, int line)
 
     test((r = pkt_encode((const ASN1_VALUE *) req, &TANG_MSG_it, &pkt)) == 0);
     test((r = send(sock, pkt.data, pkt.size, 0)) == pkt.size);
-    test((pkt.size = recv(sock, pkt.data, sizeof(pkt.data), 0)) > 0);
+    test((r = pkt_reserve(&pkt, PKT_MAX)) == 0);
+    test((pkt.size = recv(sock, pkt.data, pkt.cap, 0)) > 0);
     test(msg = d2i_TANG_MSG(NULL, &(const unsigned char *) { pkt.data }, pkt.size));
+    pkt_cleanup(&pkt);
     return msg;
 }
 
@@ -88,7 +92,8 @@ keygen(const char *dbdir, const char *name,
 #define keygen(d, n, g, u, a) keygen(d, n, g, u, a, __FILE__, __LINE__)
 
 static TANG_MSG *
-rec(int sock, EC_KEY *key, const char *file, int line)
+rec_form(int sock, EC_KEY *key, point_conversion_form_t form,
+         const char *file, int line)
 {
     TANG_MSG_REC_REQ *req = NULL;
     const EC_GROUP *grp = NULL;
@@ -98,6 +103,40 @@ rec(int sock, EC_KEY *key, const char *file, int line)
     test(req = TANG_MSG_REC_REQ_new());
     test(conv_eckey2gkey(key, TANG_KEY_USE_REC, req->key, NULL) == 0);
     test(conv_point2os(grp, EC_GROUP_get0_generator(grp), req->x, NULL) == 0);
+
+    if (form != POINT_CONVERSION_UNCOMPRESSED) {
+        const EC_POINT *pub = EC_KEY_get0_public_key(key);
+        unsigned char buf[EC_POINT_point2oct(grp, pub, form, NULL, 0, NULL)];
+
+        test(EC_POINT_point2oct(grp, pub, form, buf, sizeof(buf), NULL) > 0);
+        test(ASN1_OCTET_STRING_set(req->key->key, buf, sizeof(buf)) > 0);
+    }
+
+    test(rep = request(sock, &(TANG_MSG) {
+        .type = TANG_MSG_TYPE_REC_REQ,
+        .val.rec.req = req
+    }, file, line));
+
+    TANG_MSG_REC_REQ_free(req);
+    return rep;
+}
+#define rec(s, k) \
+    rec_form(s, k, POINT_CONVERSION_UNCOMPRESSED, __FILE__, __LINE__)
+
+/* Asks for recovery with a key on the curve of key that is not a point. */
+static TANG_MSG *
+rec_bad(int sock, EC_KEY *key, const char *file, int line)
+{
+    TANG_MSG_REC_REQ *req = NULL;
+    const EC_GROUP *grp = NULL;
+    TANG_MSG *rep = NULL;
+
+    test(grp = EC_KEY_get0_group(key));
+    test(req = TANG_MSG_REC_REQ_new());
+    test(conv_eckey2gkey(key, TANG_KEY_USE_REC, req->key, NULL) == 0);
+    test(conv_point2os(grp, EC_GROUP_get0_generator(grp), req->x, NULL) == 0);
+    memset(&req->key->key->data[1], 0, req->key->key->length - 1);
+
     test(rep = request(sock, &(TANG_MSG) {
         .type = TANG_MSG_TYPE_REC_REQ,
         .val.rec.req = req
@@ -106,7 +145,6 @@ rec(int sock, EC_KEY *key, const char *file, int line)
     TANG_MSG_REC_REQ_free(req);
     return rep;
 }
-#define rec(s, k) rec(s, k, __FILE__, __LINE__)
 
 static TANG_MSG *
 adv(int sock, int type, int grp, EC_KEY *key, TANG_KEY_USE use,
@@ -142,6 +180,33 @@ adv(int sock, int type, int grp, EC_KEY *key, TANG_KEY_USE use,
 }
 #define adv(s, t, g, k, u) adv(s, t, g, k, u, __FILE__, __LINE__)
 
+/* Requests signatures of any type, naming count types in all: SHA-224
+ * signatures and, in between, a digest that is no signature type at all. */
+static TANG_MSG *
+adv_types(int sock, int count, const char *file, int line)
+{
+    TANG_MSG_ADV_REQ *req = NULL;
+    TANG_MSG *rep = NULL;
+
+    test(req = TANG_MSG_ADV_REQ_new());
+    test(req->body->val.grps = sk_ASN1_OBJECT_new_null());
+    req->body->type = TANG_MSG_ADV_REQ_BDY_TYPE_GRPS;
+
+    for (int i = 0; i < count; i++) {
+        int nid = i % 2 ? NID_sha256 : NID_ecdsa_with_SHA224;
+        test(sk_ASN1_OBJECT_push(req->types, OBJ_nid2obj(nid)) > 0);
+    }
+
+    test(rep = request(sock, &(TANG_MSG) {
+        .type = TANG_MSG_TYPE_ADV_REQ,
+        .val.adv.req = req
+    }, file, line));
+
+    TANG_MSG_ADV_REQ_free(req);
+    return rep;
+}
+#define adv_types(s, c) adv_types(s, c, __FILE__, __LINE__)
+
 static void
 err_verify(TANG_MSG *rep, TANG_MSG_ERR err, const char *file, int line)
 {
@@ -240,15 +305,18 @@ rec_benchmark(int sock, EC_KEY *key, int iter, const char *file, int line)
     test(conv_point2os(grp, EC_GROUP_get0_generator(grp), req.val.rec.req->x, NULL) == 0);
     test(pkt_encode((const ASN1_VALUE *) &req, &TANG_MSG_it, &out) == 0);
     TANG_MSG_REC_REQ_free(req.val.rec.req);
+    test(pkt_reserve(&in, PKT_MAX) == 0);
 
     t = gettime();
     for (int i = 0; i < iter; i++) {
         test(send(sock, out.data, out.size, 0) == out.size);
-        test(recv(sock, in.data, sizeof(in.data), 0) > 0);
+        test(recv(sock, in.data, in.cap, 0) > 0);
     }
     t = gettime() - t;
 
     fprintf(stderr, "REC (%d): %f (%d/sec)\n", iter, t, (int) (iter / t));
+    pkt_cleanup(&out);
+    pkt_cleanup(&in);
 }
 
 static void
@@ -264,15 +332,156 @@ adv_benchmark(int sock, int iter, const char *file, int line)
     req.val.adv.req->body->type = TANG_MSG_ADV_REQ_BDY_TYPE_GRPS;
     test(pkt_encode((const ASN1_VALUE *) &req, &TANG_MSG_it, &out) == 0);
     TANG_MSG_ADV_REQ_free(req.val.adv.req);
+    test(pkt_reserve(&in, PKT_MAX) == 0);
 
     t = gettime();
     for (int i = 0; i < iter; i++) {
         test(send(sock, out.data, out.size, 0) == out.size);
-        test(recv(sock, in.data, sizeof(in.data), 0) > 0);
+        test(recv(sock, in.data, in.cap, 0) > 0);
     }
     t = gettime() - t;
 
     fprintf(stderr, "ADV (%d): %f (%d/sec)\n", iter, t, (int) (iter / t));
+    pkt_cleanup(&out);
+    pkt_cleanup(&in);
+}
+
+/* Encodes a recovery request for key's generator and an advertisement
+ * request without filters. */
+static void
+requests(EC_KEY *key, pkt_t *rec, pkt_t *adv, const char *file, int line)
+{
+    TANG_MSG req = { .type = TANG_MSG_TYPE_REC_REQ };
+    const EC_GROUP *grp = NULL;
+
+    test(grp = EC_KEY_get0_group(key));
+    test(req.val.rec.req = TANG_MSG_REC_REQ_new());
+    test(conv_eckey2gkey(key, TANG_KEY_USE_REC, req.val.rec.req->key, NULL) == 0);
+    test(conv_point2os(grp, EC_GROUP_get0_generator(grp), req.val.rec.req->x, NULL) == 0);
+    test(pkt_encode((const ASN1_VALUE *) &req, &TANG_MSG_it, rec) == 0);
+    TANG_MSG_REC_REQ_free(req.val.rec.req);
+
+    req = (TANG_MSG) { .type = TANG_MSG_TYPE_ADV_REQ };
+    test(req.val.adv.req = TANG_MSG_ADV_REQ_new());
+    test(req.val.adv.req->body->val.grps = sk_ASN1_OBJECT_new_null());
+    req.val.adv.req->body->type = TANG_MSG_ADV_REQ_BDY_TYPE_GRPS;
+    test(pkt_encode((const ASN1_VALUE *) &req, &TANG_MSG_it, adv) == 0);
+    TANG_MSG_ADV_REQ_free(req.val.adv.req);
+}
+
+/* Queues up count recovery requests and, given a signing key, as many
+ * advertisement requests in between. Replies to datagrams may come back in
+ * any order, so each is checked according to its type. */
+static void
+burst(int sock, EC_KEY *key, EC_KEY *sig, int count, const char *file,
+      int line)
+{
+    TANG_MSG *rep = NULL;
+    pkt_t out = {};
+    pkt_t adv = {};
+    pkt_t in = {};
+    int nrecs = 0;
+    int nadvs = 0;
+
+    requests(key, &out, &adv, file, line);
+    test(pkt_reserve(&in, PKT_MAX) == 0);
+
+    /* Queue up several requests before reading any reply. */
+    for (int i = 0; i < count; i++) {
+        test(send(sock, out.data, out.size, 0) == out.size);
+        if (sig)
+            test(send(sock, adv.data, adv.size, 0) == adv.size);
+    }
+
+    for (int i = 0; i < (sig ? 2 : 1) * count; i++) {
+        size_t size = 0;
+
+        /* Replies may arrive coalesced on stream sockets. */
+        while (pkt_frame(in.data, in.size, &size) != 0) {
+            ssize_t r = recv(sock, &in.data[in.size], in.cap - in.size, 0);
+            test(r > 0);
+            in.size += r;
+        }
+
+        test(rep = d2i_TANG_MSG(NULL, &(const unsigned char *) { in.data }, size));
+        if (rep->type == TANG_MSG_TYPE_ADV_REP) {
+            test(sig);
+            adv_verify(rep, sig, 4, 8);
+            nadvs++;
+        } else {
+            rec_verify(rep, key);
+            nrecs++;
+        }
+        TANG_MSG_free(rep);
+
+        in.size -= size;
+        memmove(in.data, &in.data[size], in.size);
+    }
+
+    test(nrecs == count);
+    test(nadvs == (sig ? count : 0));
+    pkt_cleanup(&out);
+    pkt_cleanup(&adv);
+    pkt_cleanup(&in);
+}
+
+#define EARLY (SRV_BATCH + 1)
+
+void
+client_early(int sock, const char *dbdir);
+
+/* Checks that an advertisement requested just after a burst of recoveries
+ * is answered before they all are, as servers with crypto threads do on
+ * datagram sockets: they keep reading while the recoveries are done. One
+ * recovery more than a batch holds means that, however the server reads
+ * them, the advertisement can't just share a batch with the others. */
+void
+client_early(int sock, const char *dbdir)
+{
+    const char *file = __FILE__;
+    int line = __LINE__;
+    struct mmsghdr msgs[EARLY + 1] = {};
+    struct iovec iovs[EARLY + 1];
+    EC_KEY *key = NULL;
+    pkt_t rec = {};
+    pkt_t adv = {};
+    pkt_t in = {};
+    int last = -1;
+
+    key = keygen(dbdir, "recE", "secp521r1", "rec", true);
+    usleep(100000); /* Let the daemon have time to pick up the new file. */
+
+    requests(key, &rec, &adv, file, line);
+    test(pkt_reserve(&in, PKT_MAX) == 0);
+
+    for (int i = 0; i <= EARLY; i++) {
+        const pkt_t *pkt = i < EARLY ? &rec : &adv;
+
+        iovs[i] = (struct iovec) { .iov_base = pkt->data,
+                                   .iov_len = pkt->size };
+        msgs[i].msg_hdr = (struct msghdr) { .msg_iov = &iovs[i],
+                                            .msg_iovlen = 1 };
+    }
+
+    test(sendmmsg(sock, msgs, EARLY + 1, 0) == EARLY + 1);
+
+    for (int i = 0; i <= EARLY; i++) {
+        TANG_MSG *rep = NULL;
+
+        test((in.size = recv(sock, in.data, in.cap, 0)) > 0);
+        test(rep = d2i_TANG_MSG(NULL, &(const unsigned char *) { in.data }, in.size));
+        if (rep->type == TANG_MSG_TYPE_ADV_REP)
+            last = i;
+        else
+            rec_verify(rep, key);
+        TANG_MSG_free(rep);
+    }
+
+    test(last >= 0 && last < SRV_BATCH);
+    pkt_cleanup(&rec);
+    pkt_cleanup(&adv);
+    pkt_cleanup(&in);
+    EC_KEY_free(key);
 }
 
 void
@@ -396,16 +605,48 @@ client_checks(int sock, const char *dbdir)
     adv_verify(rep, sigB, 4, 1);
     TANG_MSG_free(rep);
 
+    /* Unknown and repeated types count towards the limit on filters... */
+    rep = adv_types(sock, PKT_OIDS);
+    adv_verify(rep, sigA, 4, 2);
+    adv_verify(rep, sigB, 4, 2);
+    TANG_MSG_free(rep);
+
+    /* ...and requests beyond it are refused. */
+    rep = adv_types(sock, PKT_OIDS + 1);
+    err_verify(rep, TANG_MSG_ERR_INVALID_REQUEST);
+    TANG_MSG_free(rep);
+
+    /* Requests larger than an MTU are read whole, and refused all the same. */
+    rep = adv_types(sock, 400);
+    err_verify(rep, TANG_MSG_ERR_INVALID_REQUEST);
+    TANG_MSG_free(rep);
+
     /* Test recovery of an advertised key. */
     rep = rec(sock, recB);
     rec_verify(rep, recB);
     TANG_MSG_free(rep);
 
+    /* Test recovery of an advertised key, sent in compressed form. */
+    rep = rec_form(sock, recB, POINT_CONVERSION_COMPRESSED, __FILE__, __LINE__);
+    rec_verify(rep, recB);
+    TANG_MSG_free(rep);
+
     /* Test recovery using an advertised signature key. */
     rep = rec(sock, sigB);
     err_verify(rep, TANG_MSG_ERR_NOTFOUND_KEY);
     TANG_MSG_free(rep);
 
+    /* Test recovery with a key that is not a point on the curve. */
+    rep = rec_bad(sock, recB, __FILE__, __LINE__);
+    err_verify(rep, TANG_MSG_ERR_INVALID_REQUEST);
+    TANG_MSG_free(rep);
+
+    /* Test a burst of requests, answered in batches. */
+    burst(sock, recB, NULL, 8, __FILE__, __LINE__);
+
+    /* Test advertisements and recoveries mixed in the same batches. */
+    burst(sock, recB, sigB, 8, __FILE__, __LINE__);
+
     /* Benchmark. */
     adv_benchmark(sock, 10000, __FILE__, __LINE__);
     rec_benchmark(sock, sigB, 10000, __FILE__, __LINE__);
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../grp.h"
+
+#include <error.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/objects.h>
+
+#define ITER 500
+
+static void
+test(bool cond, const char *str, const char *file, int line)
+{
+    if (cond)
+      return;
+
+    error(EXIT_FAILURE, 0, "FAILURE: %s:%d:\n%s", file, line, str);
+}
+
+#define _str(x) # x
+#define test(x) test((x), _str(x), __FILE__, __LINE__)
+
+static double
+gettime(void)
+{
+    struct timespec ts;
+    double t;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t = ts.tv_nsec;
+    t /= 1000000000;
+    t += ts.tv_sec;
+    return t;
+}
+
+/* Multiplies the point (given as octets) by k on grp, ITER times, returning
+ * the time taken and the encoded result. */
+static double
+mul(const EC_GROUP *grp, const unsigned char *in, size_t len,
+    const BIGNUM *k, unsigned char *out, BN_CTX *ctx)
+{
+    EC_POINT *x = NULL;
+    EC_POINT *y = NULL;
+    double t;
+
+    test(x = EC_POINT_new(grp));
+    test(y = EC_POINT_new(grp));
+    test(EC_POINT_oct2point(grp, x, in, len, ctx) > 0);
+
+    t = gettime();
+    for (int i = 0; i < ITER; i++)
+        test(EC_POINT_mul(grp, y, NULL, x, k, ctx) > 0);
+    t = gettime() - t;
+
+    test(EC_POINT_point2oct(grp, y, POINT_CONVERSION_UNCOMPRESSED,
+                            out, len, ctx) == len);
+
+    EC_POINT_free(x);
+    EC_POINT_free(y);
+    return t;
+}
+
+static void
+bench(int nid, BN_CTX *ctx)
+{
+    const EC_GROUP *fast = NULL;
+    EC_GROUP *generic = NULL;
+    EC_GROUP *named = NULL;
+    EC_POINT *x = NULL;
+    BIGNUM *ord = NULL;
+    BIGNUM *k = NULL;
+    double tg, tn, tf;
+    size_t len;
+
+    test(fast = grp_get(nid));
+    test(fast == grp_get(nid));
+    test(generic = grp_new(nid, EC_GFp_mont_method()));
+    test(named = EC_GROUP_new_by_curve_name(nid));
+
+    /* A random point and a random scalar. */
+    test(ord = BN_new());
+    test(k = BN_new());
+    test(EC_GROUP_get_order(generic, ord, ctx) > 0);
+    test(BN_rand_range(k, ord) > 0);
+    test(x = EC_POINT_new(generic));
+    test(EC_POINT_mul(generic, x, k, NULL, NULL, ctx) > 0);
+    test(BN_rand_range(k, ord) > 0);
+
+    len = EC_POINT_point2oct(generic, x, POINT_CONVERSION_UNCOMPRESSED,
+                             NULL, 0, ctx);
+    test(len > 0);
+
+    unsigned char in[len];
+    unsigned char og[len];
+    unsigned char on[len];
+    unsigned char of[len];
+
+    test(EC_POINT_point2oct(generic, x, POINT_CONVERSION_UNCOMPRESSED,
+                            in, len, ctx) == len);
+
+    tg = mul(generic, in, len, k, og, ctx);
+    tn = mul(named, in, len, k, on, ctx);
+    tf = mul(fast, in, len, k, of, ctx);
+
+    /* All implementations must agree. */
+    test(memcmp(og, on, len) == 0);
+    test(memcmp(og, of, len) == 0);
+
+    fprintf(stderr, "%s (%d): generic %f, named %f, shared %f (%.1fx)\n",
+            OBJ_nid2sn(nid), ITER, tg, tn, tf, tg / tf);
+
+    EC_POINT_free(x);
+    EC_GROUP_free(named);
+    EC_GROUP_free(generic);
+    BN_free(ord);
+    BN_free(k);
+}
+
+/* Maps OIDs back to NIDs, both for curves and for a table of our own. */
+static void
+oids(void)
+{
+    static const int nids[] = { NID_sha256, NID_undef, NID_sha512 };
+    unsigned char oid[GRP_OID];
+    grp_oids_t tab = {};
+    size_t len;
+
+    len = grp_oid(OBJ_nid2obj(NID_secp384r1), oid);
+    test(len > 0);
+    test(grp_oid2nid(oid, len) == NID_secp384r1);
+    test(grp_oid2nid(oid, len - 1) == NID_undef);
+
+    test(grp_oids_init(&tab, nids, sizeof(nids) / sizeof(*nids)) == 0);
+    test(tab.n == 2);
+    test(grp_oids_find(&tab, oid, len) == NID_undef);
+
+    len = grp_oid(OBJ_nid2obj(NID_sha512), oid);
+    test(grp_oids_find(&tab, oid, len) == NID_sha512);
+    test(grp_oid2nid(oid, len) == NID_undef);
+    free(tab.oids);
+}
+
+int
+main(int argc, char *argv[])
+{
+    BN_CTX *ctx = NULL;
+
+    test(ctx = BN_CTX_new());
+
+    test(!grp_get(NID_undef));
+    oids();
+
+    bench(NID_X9_62_prime256v1, ctx);
+    bench(NID_secp384r1, ctx);
+    bench(NID_secp521r1, ctx);
+
+    BN_CTX_free(ctx);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char tempdir[] = "/var/tmp/tmpXXXXXX";
+
+static void
+onexit(void)
+{
+    const char *cmd = "rm -rf ";
+    char tmp[strlen(cmd) + strlen(tempdir) + 1];
+
+    strcpy(tmp, cmd);
+    strcat(tmp, tempdir);
+    system(tmp);
+}
+
+const char *
+keys_init(void);
+
+/* Makes a temporary key directory, removed when the test exits. */
+const char *
+keys_init(void)
+{
+    if (!mkdtemp(tempdir))
+        error(EXIT_FAILURE, errno, "Error calling mkdtemp()");
+
+    atexit(onexit);
+    return tempdir;
+}
+
+void
+keys_run(const char *prog, const char *args, const char *name);
+
+/* Runs one of our programs on a file in the key directory, such as
+ * keys_run("tang-gen", "-A secp384r1 sig", "sig"). */
+void
+keys_run(const char *prog, const char *args, const char *name)
+{
+    char cmd[PATH_MAX * 2];
+
+    if (snprintf(cmd, sizeof(cmd), "../progs/%s %s %s/%s >/dev/null",
+                 prog, args, tempdir, name) >= (int) sizeof(cmd))
+        error(EXIT_FAILURE, 0, "FAILURE: command too long");
+
+    if (system(cmd) != 0)
+        error(EXIT_FAILURE, 0, "FAILURE: %s", cmd);
+}
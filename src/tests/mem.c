@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../mem.h"
+#include "../conv.h"
+#include "../progs/adv.h"
+#include "../progs/rec.h"
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+
+#define WARMUP 16
+#define ITER 1000
+
+static void
+test(bool cond, const char *str, const char *file, int line)
+{
+    if (cond)
+      return;
+
+    error(EXIT_FAILURE, 0, "FAILURE: %s:%d:\n%s", file, line, str);
+}
+
+#define _str(x) # x
+#define test(x) test((x), _str(x), __FILE__, __LINE__)
+
+const char *
+keys_init(void);
+
+void
+keys_run(const char *prog, const char *args, const char *name);
+
+static const char *tempdir;
+static pkt_t reqs[3];
+static pkt_t rep;
+static size_t ncalls;
+
+/* Counts every call to the system allocator, whoever makes it. Sanitizers
+ * bring allocators of their own, so they only get libcrypto's count. */
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *
+malloc(size_t size)
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+#endif
+
+static void
+rec_request(const db_key_t *key, pkt_t *pkt, BN_CTX *ctx)
+{
+    TANG_MSG_REC_REQ *req = NULL;
+    const EC_GROUP *grp = NULL;
+    EC_KEY *ec = NULL;
+
+    test(ec = db_key_get(key));
+    test(grp = EC_KEY_get0_group(ec));
+    test(req = TANG_MSG_REC_REQ_new());
+    test(conv_eckey2gkey(ec, TANG_KEY_USE_REC, req->key, ctx) == 0);
+    test(conv_point2os(grp, EC_GROUP_get0_generator(grp), req->x, ctx) == 0);
+    test(pkt_encode((ASN1_VALUE *) &(TANG_MSG) {
+        .type = TANG_MSG_TYPE_REC_REQ,
+        .val.rec.req = req
+    }, &TANG_MSG_it, pkt) == 0);
+    TANG_MSG_REC_REQ_free(req);
+}
+
+static void
+adv_request(pkt_t *pkt)
+{
+    TANG_MSG_ADV_REQ *req = NULL;
+
+    test(req = TANG_MSG_ADV_REQ_new());
+    test(req->body->val.grps = sk_ASN1_OBJECT_new_null());
+    req->body->type = TANG_MSG_ADV_REQ_BDY_TYPE_GRPS;
+    test(pkt_encode((ASN1_VALUE *) &(TANG_MSG) {
+        .type = TANG_MSG_TYPE_ADV_REQ,
+        .val.adv.req = req
+    }, &TANG_MSG_it, pkt) == 0);
+    TANG_MSG_ADV_REQ_free(req);
+}
+
+/* Answers each request the way srv does. */
+static void
+answer(const db_t *db, const adv_t *adv, BN_CTX *ctx)
+{
+    TANG_MSG_ERR err;
+    pkt_rec_t rec;
+    pkt_adv_t req;
+
+    for (size_t i = 0; i < sizeof(reqs) / sizeof(*reqs); i++) {
+        if (pkt_parse_rec(&reqs[i], &rec) == 0) {
+            rec_decrypt(db, &rec, &(pkt_t *) { &rep }, &err, 1, ctx);
+            test(err == TANG_MSG_ERR_NONE);
+            continue;
+        }
+
+        test(pkt_parse_adv(&reqs[i], &req) == 0);
+        test(adv_sign(adv, &req, &rep) == TANG_MSG_ERR_NONE);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    BN_CTX *ctx = NULL;
+    adv_t *adv = NULL;
+    db_t *db = NULL;
+    size_t nreqs = 0;
+    size_t calls;
+    size_t n;
+
+    /* This must come before anything else touches libcrypto. */
+    test(mem_init() == 0);
+    OpenSSL_add_all_algorithms();
+
+    tempdir = keys_init();
+
+    keys_run("tang-gen", "-A secp384r1 sig", "sig");
+    keys_run("tang-gen", "-A secp384r1 rec", "rec384");
+    keys_run("tang-gen", "-A secp521r1 rec", "rec521");
+
+    test(ctx = BN_CTX_new());
+    test(db_open(tempdir, &db) == 0);
+    test(adv_init(&adv) == 0);
+    test(adv_update(adv, db) == 0);
+
+    for (size_t i = 0; i < db->nkeys; i++) {
+        if (db->keys[i].use == TANG_KEY_USE_REC)
+            rec_request(&db->keys[i], &reqs[nreqs++], ctx);
+    }
+    test(nreqs == 2);
+    adv_request(&reqs[nreqs]);
+
+    /* Once warm, answering requests must not touch the system allocator. */
+    for (int i = 0; i < WARMUP; i++)
+        answer(db, adv, ctx);
+
+    n = mem_sys();
+    calls = __atomic_load_n(&ncalls, __ATOMIC_RELAXED);
+    for (int i = 0; i < ITER; i++)
+        answer(db, adv, ctx);
+    calls = __atomic_load_n(&ncalls, __ATOMIC_RELAXED) - calls;
+    fprintf(stderr, "System allocations (%d): %zu by libcrypto, %zu in all\n",
+            ITER, mem_sys() - n, calls);
+    test(mem_sys() == n);
+    test(calls == 0);
+
+    adv_free(adv);
+    db_free(db);
+    BN_CTX_free(ctx);
+    EVP_cleanup();
+    return 0;
+}
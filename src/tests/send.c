@@ -70,20 +70,23 @@ main(int argc, char *argv[])
 
     OpenSSL_add_all_algorithms();
 
-    srand(time(NULL));
-    port = 1024 + rand() % (UINT16_MAX - 1024);
-    snprintf(host, sizeof(host), "localhost:%u", port);
-
     lsock = socket(AF_INET, SOCK_STREAM, 0);
     if (lsock < 0)
         error(EXIT_FAILURE, errno, "Error calling socket()");
 
+    /* Let the kernel pick the port, so parallel tests can't collide. */
     bsa.sin_family = AF_INET;
-    bsa.sin_port = htons(port);
     bsa.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(lsock, (struct sockaddr *) &bsa, sizeof(sa)) < 0)
+    if (bind(lsock, (struct sockaddr *) &bsa, sizeof(bsa)) < 0)
         error(EXIT_FAILURE, errno, "Error calling bind()");
 
+    slen = sizeof(bsa);
+    if (getsockname(lsock, (struct sockaddr *) &bsa, &slen) < 0)
+        error(EXIT_FAILURE, errno, "Error calling getsockname()");
+
+    port = ntohs(bsa.sin_port);
+    snprintf(host, sizeof(host), "localhost:%u", port);
+
     if (listen(lsock, 1) < 0)
         error(EXIT_FAILURE, errno, "Error calling listen()");
 
@@ -98,12 +101,17 @@ main(int argc, char *argv[])
 
     if (pid == 0) {
         close(lsock);
-        execlp(BIN, BIN, "-d", tempdir, host, NULL);
+        execlp(BIN, BIN, "-d", tempdir,
+#ifdef URING
+               "-u",
+#endif
+               host, NULL);
         exit(EXIT_FAILURE);
     }
 
     atexit(onexit);
 
+    slen = sizeof(sa);
     asock = accept(lsock, &sa, &slen);
     if (asock < 0)
         error(EXIT_FAILURE, errno, "Error calling accept()");
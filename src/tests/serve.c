@@ -18,11 +18,13 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <error.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -32,10 +34,19 @@
 #include <openssl/evp.h>
 
 #define BIN "../progs/tang-serve"
+#define _str(x) # x
+#define str(x) _str(x)
+
+#ifndef WORKERS
+#define WORKERS 1
+#endif
 
 void
 client_checks(int sock, const char *dbdir);
 
+void
+client_early(int sock, const char *dbdir);
+
 static char tempdir[] = "/var/tmp/tmpXXXXXX";
 static pid_t pid;
 
@@ -53,18 +64,50 @@ onexit(void)
     system(tmp);
 }
 
+#ifdef STREAM
+/* Connects to the listening socket, which the server accepts on. */
+static int
+dial(const struct sockaddr_un *addr)
+{
+    int sock;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        error(EXIT_FAILURE, errno, "Error calling socket()");
+
+    if (connect(sock, (const struct sockaddr *) addr, sizeof(*addr)) != 0)
+        error(EXIT_FAILURE, errno, "Error calling connect()");
+
+    return sock;
+}
+#endif
+
 int
 main(int argc, char *argv[])
 {
-    int socks[2];
+    int socks[2] = { -1, -1 };
 
     OpenSSL_add_all_algorithms();
 
     if (!mkdtemp(tempdir))
         error(EXIT_FAILURE, errno, "Error calling mkdtemp()");
 
+#ifdef STREAM
+    /* The name starts with a dot, so the database ignores it. */
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.sock", tempdir);
+
+    socks[1] = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socks[1] < 0)
+        error(EXIT_FAILURE, errno, "Error calling socket()");
+
+    if (bind(socks[1], (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(socks[1], 16) != 0)
+        error(EXIT_FAILURE, errno, "Error calling listen()");
+#else
     if (socketpair(AF_UNIX, SOCK_DGRAM, 0, socks) != 0)
         error(EXIT_FAILURE, errno, "Error calling socketpair()");
+#endif
 
     pid = fork();
     if (pid < 0)
@@ -72,17 +115,52 @@ main(int argc, char *argv[])
 
     if (pid == 0) {
         close(socks[0]);
-        dup2(socks[1], 3);
-        close(socks[1]);
+        if (socks[1] != 3) {
+            dup2(socks[1], 3);
+            close(socks[1]);
+        }
         setenv("LISTEN_FDS", "1", true);
-        execlp(BIN, BIN, "-d", tempdir, NULL);
+        execlp(BIN, BIN, "-d", tempdir, "-w", str(WORKERS),
+#ifdef URING
+               "-u",
+#endif
+#ifdef EVICT
+               "-e", str(EVICT),
+#endif
+#ifdef CRYPTO
+               "-c", str(CRYPTO),
+#endif
+#ifdef PREFORK
+               "-p", str(PREFORK),
+#endif
+#ifdef STREAM
+               "-k", str(STREAM),
+#endif
+               NULL);
         exit(EXIT_FAILURE);
     }
 
     close(socks[1]);
     atexit(onexit);
 
+#ifdef STREAM
+    /* A connection left idle is closed, while the others are served. */
+    int idle = dial(&addr);
+    char c;
+
+    socks[0] = dial(&addr);
+    client_checks(socks[0], tempdir);
+
+    sleep(STREAM + 2);
+    if (recv(idle, &c, 1, 0) != 0)
+        error(EXIT_FAILURE, 0, "Idle connection not closed");
+    close(idle);
+#else
     client_checks(socks[0], tempdir);
+#if defined(CRYPTO) && !defined(URING)
+    client_early(socks[0], tempdir);
+#endif
+#endif
 
     close(socks[0]);
     EVP_cleanup();
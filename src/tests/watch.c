@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../progs/db.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <error.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+static void
+test(bool cond, const char *str, const char *file, int line)
+{
+    if (cond)
+      return;
+
+    error(EXIT_FAILURE, 0, "FAILURE: %s:%d:\n%s", file, line, str);
+}
+
+#define _str(x) # x
+#define test(x) test((x), _str(x), __FILE__, __LINE__)
+
+const char *
+keys_init(void);
+
+void
+keys_run(const char *prog, const char *args, const char *name);
+
+static const char *tempdir;
+
+static const db_key_t *
+find(const db_t *db, const char *name)
+{
+    for (size_t i = 0; i < db->nkeys; i++) {
+        if (strcmp(db->keys[i].file->name, name) == 0)
+            return &db->keys[i];
+    }
+
+    return NULL;
+}
+
+/* Returns the file a key was read from, which stays the same unless the
+ * key is read again. */
+static const db_file_t *
+file(const db_t *db, const char *name)
+{
+    const db_key_t *key = find(db, name);
+
+    return key ? key->file : NULL;
+}
+
+/* Makes the kernel drop events, by causing more than its queue holds. The
+ * kernel merges repeats of the last event, so two files take turns. */
+static void
+overflow(void)
+{
+    char paths[2][PATH_MAX];
+    long max = 0;
+    FILE *f = NULL;
+
+    test(f = fopen("/proc/sys/fs/inotify/max_queued_events", "r"));
+    test(fscanf(f, "%ld", &max) == 1);
+    test(fclose(f) == 0);
+
+    for (int i = 0; i < 2; i++) {
+        test(snprintf(paths[i], sizeof(paths[i]), "%s/.noise%d",
+                      tempdir, i) > 0);
+        test(f = fopen(paths[i], "w"));
+        test(fclose(f) == 0);
+    }
+
+    for (long i = 0; i <= max; i++)
+        test(chmod(paths[i % 2], 0600) == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const db_file_t *same = NULL;
+    const db_file_t *attr = NULL;
+    const db_file_t *new = NULL;
+    char path[PATH_MAX];
+    size_t nevents = 0;
+    db_t *db = NULL;
+    int fd = -1;
+
+    OpenSSL_add_all_algorithms();
+
+    tempdir = keys_init();
+
+    keys_run("tang-gen", "-A secp384r1 sig", "gone");
+    keys_run("tang-gen", "-a secp384r1 rec", "attr");
+    keys_run("tang-gen", "-A secp384r1 rec", "same");
+
+    test(db_open(tempdir, &db) == 0);
+    test(same = file(db, "same"));
+    test(attr = file(db, "attr"));
+    test(!find(db, "attr")->adv);
+
+    /* None of these changes will be reported. */
+    overflow();
+    keys_run("tang-gen", "-A secp521r1 rec", "new");
+    keys_run("tang-mod", "-A", "attr");
+    test(snprintf(path, sizeof(path), "%s/gone", tempdir) > 0);
+    test(unlink(path) == 0);
+
+    test(db_event(db) == 0);
+    test(db->rescan);
+    test(db_apply(db) == 0);
+    test(!db->rescan);
+    test(db->nchgs == 0);
+
+    /* Only what changed is read again. */
+    test(!find(db, "gone"));
+    test(new = file(db, "new"));
+    test(file(db, "attr") == attr);
+    test(find(db, "attr")->adv);
+    test(file(db, "same") == same);
+    test(db->nkeys == 3);
+
+    /* With nothing lost, a rescan finds nothing to do. */
+    db->rescan = true;
+    test(db_apply(db) == 0);
+    test(file(db, "new") == new);
+    test(file(db, "attr") == attr);
+    test(file(db, "same") == same);
+    test(db->nkeys == 3);
+
+    /* Like tang-gen, set attributes before writing: only the write counts,
+     * as the file isn't a key until then. */
+    nevents = db->nevents;
+    test(snprintf(path, sizeof(path), "%s/half", tempdir) > 0);
+    test((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) >= 0);
+    test(fchmod(fd, 0400) == 0);
+    test(db_event(db) == 0);
+    test(db->nchgs == 0);
+    test(db->nevents == nevents);
+    test(close(fd) == 0);
+    test(db_event(db) == 0);
+    test(db->nchgs == 1);
+    test(db->nevents == nevents + 1);
+
+    db_free(db);
+    EVP_cleanup();
+    return 0;
+}